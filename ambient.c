@@ -0,0 +1,232 @@
+/* ambient hackerspace status */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "matelight.h"
+
+/*
+ * Shows whether the space is open while nothing else is on: a lit door when
+ * open, a dark red one when closed, and one dot per person at the bottom.
+ * The status comes from MQTT as plain "open"/"closed" (or 1/0, true/false,
+ * on/off) or as JSON: {"open": true, "people": 3}.
+ *
+ * The scene is only drawn again when the status, the grid or the slow
+ * breathing phase of an open door changes, otherwise the last one is reused
+ * and the main loop does not send unchanged frames.
+ */
+
+#define AMBIENT_PHASES      16
+#define AMBIENT_PERIOD      8.0     /* seconds per breath */
+
+#define STATUS_UNKNOWN      -1
+#define STATUS_CLOSED       0
+#define STATUS_OPEN         1
+
+struct ambient_status {
+    int open;
+    int people;
+};
+
+static struct ambient_status status = { STATUS_UNKNOWN, 0 };
+static unsigned long status_seq = 0;
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char scene[MAX_GRID_SIZE * 3];
+static unsigned long scene_seq = 0;
+static int scene_phase = -1;
+static int scene_width = 0;
+static int scene_height = 0;
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static void status_value(const char *path, int type, const char *value, size_t len, void *arg)
+{
+    struct ambient_status *new_status = arg;
+
+    (void)len;
+
+    if (strcmp(path, "open") == 0) {
+        if (type == JSON_TYPE_TRUE || type == JSON_TYPE_FALSE) {
+            new_status->open = type == JSON_TYPE_TRUE ? STATUS_OPEN : STATUS_CLOSED;
+        } else if (type == JSON_TYPE_NUMBER) {
+            new_status->open = atoi(value) ? STATUS_OPEN : STATUS_CLOSED;
+        }
+    } else if (strcmp(path, "people") == 0 && type == JSON_TYPE_NUMBER) {
+        new_status->people = MAX(atoi(value), 0);
+    }
+}
+
+static int parse_word(const char *word)
+{
+    if (strcasecmp(word, "open") == 0 || strcasecmp(word, "1") == 0 || strcasecmp(word, "true") == 0 || strcasecmp(word, "on") == 0)
+        return STATUS_OPEN;
+    if (strcasecmp(word, "closed") == 0 || strcasecmp(word, "0") == 0 || strcasecmp(word, "false") == 0 || strcasecmp(word, "off") == 0)
+        return STATUS_CLOSED;
+
+    return STATUS_UNKNOWN;
+}
+
+// Called for MQTT status messages
+bool ambient_set_status(const void *payload, size_t len)
+{
+    struct ambient_status new_status = { STATUS_UNKNOWN, 0 };
+    struct json_parser parser;
+    char word[16];
+    const char *data = payload;
+
+    while (len > 0 && (*data == ' ' || *data == '\t' || *data == '\r' || *data == '\n')) {
+        data++;
+        len--;
+    }
+    while (len > 0 && (data[len - 1] == ' ' || data[len - 1] == '\t' || data[len - 1] == '\r' || data[len - 1] == '\n'))
+        len--;
+
+    if (len > 0 && *data == '{') {
+        json_init(&parser, status_value, &new_status);
+        if (! json_feed(&parser, data, len) || ! json_finish(&parser))
+            new_status.open = STATUS_UNKNOWN;
+    } else if (len > 0 && len < sizeof(word)) {
+        memcpy(word, data, len);
+        word[len] = '\0';
+        new_status.open = parse_word(word);
+    }
+
+    if (new_status.open == STATUS_UNKNOWN) {
+        fprintf(stderr, "ambient: invalid status: %.*s\n", (int)len, data);
+        return false;
+    }
+
+    if (pthread_mutex_lock(&status_mutex) != 0)
+        return false;
+    if (new_status.open != status.open || new_status.people != status.people) {
+        fprintf(stderr, "ambient: space %s, %d people\n", new_status.open == STATUS_OPEN ? "open" : "closed", new_status.people);
+        status = new_status;
+        status_seq++;
+    }
+    (void)pthread_mutex_unlock(&status_mutex);
+
+    loop_wakeup();
+
+    return true;
+}
+
+static unsigned int scale_color(unsigned int color, unsigned int level)
+{
+    unsigned int r = (((color >> 16) & 0xff) * level) >> 8;
+    unsigned int g = (((color >> 8) & 0xff) * level) >> 8;
+    unsigned int b = ((color & 0xff) * level) >> 8;
+
+    return COLOR_RGB(r, g, b);
+}
+
+static void draw(const struct ambient_status *cur, int phase)
+{
+    int door_width = MAX(grid_width / 4, 4);
+    int door_height = grid_height - 3;
+    int door_x = (grid_width - door_width) / 2;
+    int door_y = 1;
+    unsigned int level = 0;
+    unsigned int fill;
+    unsigned int frame;
+    int x, y, i;
+
+    memset(scene, '\0', grid_width * grid_height * 3);
+
+    // Breathes between 60% and 100% while open
+    if (cur->open == STATUS_OPEN) {
+        level = phase <= AMBIENT_PHASES / 2 ? phase : AMBIENT_PHASES - phase;
+        level = 154 + ((level * 102) / (AMBIENT_PHASES / 2));
+        fill = scale_color(COLOR_YELLOW, level);
+        frame = scale_color(COLOR_WHITE, 96);
+    } else {
+        fill = scale_color(COLOR_RED, 96);
+        frame = scale_color(COLOR_RED, 160);
+    }
+
+    for (y = door_y; y < door_y + door_height; y++) {
+        for (x = door_x; x < door_x + door_width; x++) {
+            if (y == door_y || x == door_x || x == door_x + door_width - 1) {
+                set_pixel(scene, y, x, frame);
+            } else {
+                set_pixel(scene, y, x, fill);
+            }
+        }
+    }
+
+    for (i = 0; i < cur->people && (i * 2) + 1 < grid_width; i++) {
+        set_pixel(scene, grid_height - 1, (i * 2) + 1, COLOR_CYAN);
+    }
+}
+
+static void render(bool *display, char *screen)
+{
+    struct ambient_status cur;
+    unsigned long seq;
+    int phase = 0;
+
+    if (pthread_mutex_lock(&status_mutex) != 0) {
+        *display = false;
+        return;
+    }
+    cur = status;
+    seq = status_seq;
+    (void)pthread_mutex_unlock(&status_mutex);
+
+    if (cur.open == STATUS_UNKNOWN) {
+        *display = false;
+        return;
+    }
+
+    if (cur.open == STATUS_OPEN)
+        phase = (int)(get_monotonic_time() * AMBIENT_PHASES / AMBIENT_PERIOD) % AMBIENT_PHASES;
+
+    if (seq != scene_seq || phase != scene_phase || grid_width != scene_width || grid_height != scene_height) {
+        draw(&cur, phase);
+        scene_seq = seq;
+        scene_phase = phase;
+        scene_width = grid_width;
+        scene_height = grid_height;
+    }
+
+    memcpy(screen, scene, grid_width * grid_height * 3);
+    *display = true;
+}
+
+static bool idle(void)
+{
+    bool unknown;
+
+    if (pthread_mutex_lock(&status_mutex) != 0)
+        return true;
+    unknown = status.open == STATUS_UNKNOWN;
+    (void)pthread_mutex_unlock(&status_mutex);
+
+    return unknown;
+}
+
+const struct game ambient_game = {
+    "ambient",
+    false,
+    false,
+    0.1,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    render,
+    idle,
+    true,
+};
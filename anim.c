@@ -0,0 +1,305 @@
+/* binary animations received over MQTT */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "matelight.h"
+
+/*
+ * Payload format:
+ *
+ *   0  'M' 'A'         magic
+ *   2  u8              version (1)
+ *   3  u8              format: 0 raw RGB, 1 palette + RLE
+ *   4  u8              frames per second (1-50)
+ *   5  u8              number of frames (1-64)
+ *   6  u8, u8          width, height (at most the largest grid)
+ *   8  u8              times to play (0 and 1: once)
+ *   9  u8              reserved
+ *  10                  frame data
+ *
+ * Raw frames are width * height RGB triplets each. Palette frames start with
+ * one u8 palette size (0: 256) and the RGB palette, followed by runs of
+ * { u8 length - 1, u8 palette index } which fill the frames one after the
+ * other, a run does not cross the end of a frame.
+ *
+ * Frames are decoded straight from the message into a ring of frame slots.
+ * Only animation_load() writes the free part of the ring, the animation game
+ * plays and releases animations in order, the mutex only guards the bookkeeping.
+ * Smaller animations are centered, larger ones cut.
+ */
+
+#define ANIM_MAGIC_0        'M'
+#define ANIM_MAGIC_1        'A'
+#define ANIM_VERSION        1
+#define ANIM_HEADER_SIZE    10
+
+#define ANIM_FORMAT_RGB     0
+#define ANIM_FORMAT_PALETTE 1
+
+#define ANIM_RING_FRAMES    64
+#define ANIM_QUEUE_SIZE     4
+#define ANIM_MAX_FPS        50
+
+struct animation {
+    unsigned int first;
+    unsigned int frames;
+    unsigned int fps;
+    unsigned int plays;
+    unsigned int width;
+    unsigned int height;
+};
+
+static unsigned char ring[ANIM_RING_FRAMES][MAX_GRID_WIDTH * MAX_GRID_HEIGHT * 3];
+static unsigned int ring_head = 0;
+static unsigned int ring_used = 0;
+static struct animation queue[ANIM_QUEUE_SIZE];
+static unsigned int queue_head = 0;
+static unsigned int queue_len = 0;
+static pthread_mutex_t anim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double play_start = 0.0;
+
+static unsigned long rejected = 0;
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static bool decode_rgb(const struct animation *anim, const unsigned char *data, size_t len)
+{
+    size_t frame_size = anim->width * anim->height * 3;
+    unsigned int i;
+
+    if (len != frame_size * anim->frames)
+        return false;
+
+    for (i = 0; i < anim->frames; i++) {
+        memcpy(ring[(anim->first + i) % ANIM_RING_FRAMES], data + (i * frame_size), frame_size);
+    }
+
+    return true;
+}
+
+static bool decode_palette(const struct animation *anim, const unsigned char *data, size_t len)
+{
+    const unsigned char *palette;
+    unsigned int palette_size;
+    unsigned int frame_pixels = anim->width * anim->height;
+    unsigned int i, pixel, run, index;
+    unsigned char *frame;
+    size_t pos;
+
+    if (len < 1)
+        return false;
+
+    palette_size = data[0] ? data[0] : 256;
+    palette = data + 1;
+    pos = 1 + (palette_size * 3);
+    if (len < pos)
+        return false;
+
+    for (i = 0; i < anim->frames; i++) {
+        frame = ring[(anim->first + i) % ANIM_RING_FRAMES];
+        for (pixel = 0; pixel < frame_pixels; pixel += run) {
+            if (pos + 2 > len)
+                return false;
+            run = data[pos] + 1;
+            index = data[pos + 1];
+            pos += 2;
+            if (pixel + run > frame_pixels || index >= palette_size)
+                return false;
+            while (run-- > 0) {
+                memcpy(frame + (pixel++ * 3), palette + (index * 3), 3);
+            }
+            run = 0;
+        }
+    }
+
+    return pos == len;
+}
+
+// Called for MQTT messages only, it owns the free part of the ring
+bool animation_load(const void *payload, size_t len)
+{
+    const unsigned char *data = payload;
+    struct animation anim = { 0 };
+    unsigned int free_frames;
+    bool ok;
+
+    if (len < ANIM_HEADER_SIZE || data[0] != ANIM_MAGIC_0 || data[1] != ANIM_MAGIC_1 || data[2] != ANIM_VERSION ||
+        data[4] == 0 || data[4] > ANIM_MAX_FPS || data[5] == 0 || data[5] > ANIM_RING_FRAMES ||
+        data[6] == 0 || data[6] > MAX_GRID_WIDTH || data[7] == 0 || data[7] > MAX_GRID_HEIGHT) {
+        rejected++;
+        return false;
+    }
+
+    if (pthread_mutex_lock(&anim_mutex) != 0)
+        return false;
+    free_frames = ANIM_RING_FRAMES - ring_used;
+    anim.first = (ring_head + ring_used) % ANIM_RING_FRAMES;
+    ok = queue_len < ANIM_QUEUE_SIZE;
+    (void)pthread_mutex_unlock(&anim_mutex);
+
+    anim.fps = data[4];
+    anim.frames = data[5];
+    anim.width = data[6];
+    anim.height = data[7];
+    anim.plays = MAX(data[8], 1);
+
+    if (! ok || anim.frames > free_frames) {
+        fprintf(stderr, "animation: dropped, %u of %u frames in use\n", ANIM_RING_FRAMES - free_frames, ANIM_RING_FRAMES);
+        rejected++;
+        return false;
+    }
+
+    if (data[3] == ANIM_FORMAT_RGB) {
+        ok = decode_rgb(&anim, data + ANIM_HEADER_SIZE, len - ANIM_HEADER_SIZE);
+    } else if (data[3] == ANIM_FORMAT_PALETTE) {
+        ok = decode_palette(&anim, data + ANIM_HEADER_SIZE, len - ANIM_HEADER_SIZE);
+    } else {
+        ok = false;
+    }
+    if (! ok) {
+        fprintf(stderr, "animation: invalid frame data\n");
+        rejected++;
+        return false;
+    }
+
+    if (pthread_mutex_lock(&anim_mutex) != 0)
+        return false;
+    queue[(queue_head + queue_len) % ANIM_QUEUE_SIZE] = anim;
+    queue_len++;
+    ring_used += anim.frames;
+    (void)pthread_mutex_unlock(&anim_mutex);
+
+    fprintf(stderr, "animation: queued %ux%u, %u frames at %u fps\n", anim.width, anim.height, anim.frames, anim.fps);
+    loop_wakeup();
+
+    return true;
+}
+
+unsigned long animation_rejected(void)
+{
+    return rejected;
+}
+
+// Seconds until the playing animation shows its next frame, -1 if none is playing
+double animation_next_frame(void)
+{
+    double now = get_monotonic_time();
+    double wait = -1.0;
+    unsigned int idx;
+
+    if (pthread_mutex_lock(&anim_mutex) != 0)
+        return -1.0;
+
+    if (queue_len > 0 && play_start != 0.0) {
+        idx = (unsigned int)((now - play_start) * queue[queue_head].fps);
+        wait = play_start + ((double)(idx + 1) / queue[queue_head].fps) - now;
+    }
+
+    (void)pthread_mutex_unlock(&anim_mutex);
+
+    return wait;
+}
+
+// Returns the animation to show and the frame within it, releases finished ones
+static bool get_current(struct animation *anim, unsigned int *frame, bool start)
+{
+    double now = get_monotonic_time();
+    unsigned int idx;
+
+    if (pthread_mutex_lock(&anim_mutex) != 0)
+        return false;
+
+    while (queue_len > 0) {
+        *anim = queue[queue_head];
+        // Waiting ones are kept until they can be seen
+        if (play_start == 0.0 && ! start) {
+            *frame = anim->first;
+            (void)pthread_mutex_unlock(&anim_mutex);
+            return true;
+        }
+        if (play_start == 0.0)
+            play_start = now;
+
+        idx = (unsigned int)((now - play_start) * anim->fps);
+        if (idx < anim->frames * anim->plays) {
+            *frame = (anim->first + (idx % anim->frames)) % ANIM_RING_FRAMES;
+            (void)pthread_mutex_unlock(&anim_mutex);
+            return true;
+        }
+
+        ring_head = (ring_head + anim->frames) % ANIM_RING_FRAMES;
+        ring_used -= anim->frames;
+        queue_head = (queue_head + 1) % ANIM_QUEUE_SIZE;
+        queue_len--;
+        play_start = 0.0;
+    }
+
+    (void)pthread_mutex_unlock(&anim_mutex);
+
+    return false;
+}
+
+static void render(bool *display, char *screen)
+{
+    struct animation anim;
+    unsigned int frame;
+    unsigned int width, height, y;
+    int src_x, src_y, dst_x, dst_y;
+
+    if (! get_current(&anim, &frame, true)) {
+        *display = false;
+        return;
+    }
+
+    // The frame is not touched by animation_load() until it is released here
+    memset(screen, '\0', grid_width * grid_height * 3);
+    width = MIN((int)anim.width, grid_width);
+    height = MIN((int)anim.height, grid_height);
+    src_x = MAX(((int)anim.width - grid_width) / 2, 0);
+    src_y = MAX(((int)anim.height - grid_height) / 2, 0);
+    dst_x = MAX((grid_width - (int)anim.width) / 2, 0);
+    dst_y = MAX((grid_height - (int)anim.height) / 2, 0);
+    for (y = 0; y < height; y++) {
+        memcpy(screen + ((((dst_y + y) * grid_width) + dst_x) * 3),
+               ring[frame] + ((((src_y + y) * anim.width) + src_x) * 3),
+               width * 3);
+    }
+
+    *display = true;
+}
+
+static bool idle(void)
+{
+    struct animation anim;
+    unsigned int frame;
+
+    return ! get_current(&anim, &frame, false);
+}
+
+const struct game animation_game = {
+    "animation",
+    false,
+    false,
+    0.1,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    render,
+    idle,
+    true,
+};
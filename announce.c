@@ -3,7 +3,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <wchar.h>
+#include <pthread.h>
 
 #include "matelight.h"
 
@@ -14,6 +16,28 @@
 #define MODE_GAME       0
 #define MODE_DEAD       1
 
+#define ANNOUNCE_QUEUE_SIZE 16
+
+/*
+ * Announcements from any thread are queued with a priority and an expiry
+ * time. Identical texts are merged into one entry, a full queue makes room
+ * for the new one by dropping the oldest entry of the lowest priority below
+ * it. The main loop shows them one after the other, highest priority first.
+ */
+struct announcement {
+    bool used;
+    char text[ANNOUNCE_MAX_TEXT];
+    unsigned int color;
+    unsigned int bgcolor;
+    double speed;
+    int font;
+    int priority;
+    int repeat;
+    double ttl;
+    double expires;
+    unsigned long seq;
+};
+
 static int game_mode = MODE_DEAD;
 static int tick_count = 0;
 static char *announce_text = NULL;
@@ -22,8 +46,15 @@ static wchar_t *announce_wtext = NULL;
 static unsigned int announce_color = COLOR_RGB(0xff, 0xff, 0xff);
 static unsigned int announce_bgcolor = COLOR_RGB(0x00, 0x00, 0x00);
 static double announce_speed = 1.0;
+static int announce_font = ANNOUNCE_FONT_NORMAL;
 static int announce_pos = 0;
 
+static struct announcement queue[ANNOUNCE_QUEUE_SIZE] = { 0 };
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long queue_seq = 0;
+static unsigned long queue_dropped = 0;
+static unsigned long queue_expired = 0;
+
 static void reset(void)
 {
     game_mode = MODE_DEAD;
@@ -38,7 +69,7 @@ static void reset(void)
     }
 }
 
-void set_announce_text(const char *text, unsigned int color, unsigned int bgcolor, double speed)
+void set_announce_text(const char *text, unsigned int color, unsigned int bgcolor, double speed, int font)
 {
     mbstate_t state = { 0 };
     size_t len;
@@ -77,9 +108,143 @@ void set_announce_text(const char *text, unsigned int color, unsigned int bgcolo
     announce_color = color;
     announce_bgcolor = bgcolor;
     announce_speed = speed;
+    announce_font = font;
     announce_pos = 0;
 }
 
+static double get_monotonic_time(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static void expire_announcements(double now)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(queue); i++) {
+        if (queue[i].used && queue[i].expires <= now) {
+            fprintf(stderr, "announce: expired: %s\n", queue[i].text);
+            queue[i].used = false;
+            queue_expired++;
+        }
+    }
+}
+
+bool announce_push(const char *text, unsigned int color, unsigned int bgcolor, double speed, int font, int priority, int repeat, double ttl)
+{
+    struct announcement *entry = NULL;
+    struct announcement *victim = NULL;
+    double now = get_monotonic_time();
+    size_t i;
+
+    if (! text || ! *text || pthread_mutex_lock(&queue_mutex) != 0)
+        return false;
+
+    expire_announcements(now);
+
+    for (i = 0; i < ARRAY_LENGTH(queue); i++) {
+        if (! queue[i].used) {
+            if (! entry)
+                entry = &queue[i];
+            continue;
+        }
+        if (queue[i].color == color && queue[i].bgcolor == bgcolor && queue[i].font == font && strncmp(queue[i].text, text, sizeof(queue[i].text) - 1) == 0) {
+            queue[i].priority = MAX(queue[i].priority, priority);
+            queue[i].repeat = MAX(queue[i].repeat, repeat);
+            queue[i].expires = MAX(queue[i].expires, now + ttl);
+            (void)pthread_mutex_unlock(&queue_mutex);
+            fprintf(stderr, "announce: merged: %s\n", text);
+            return true;
+        }
+        if (queue[i].priority < priority && (! victim || queue[i].priority < victim->priority ||
+                                             (queue[i].priority == victim->priority && queue[i].seq < victim->seq))) {
+            victim = &queue[i];
+        }
+    }
+
+    if (! entry && victim) {
+        fprintf(stderr, "announce: queue full, dropped: %s\n", victim->text);
+        queue_dropped++;
+        entry = victim;
+    }
+
+    if (! entry) {
+        queue_dropped++;
+        (void)pthread_mutex_unlock(&queue_mutex);
+        fprintf(stderr, "announce: queue full, dropped: %s\n", text);
+        return false;
+    }
+
+    entry->used = true;
+    strncpy(entry->text, text, sizeof(entry->text) - 1);
+    entry->text[sizeof(entry->text) - 1] = '\0';
+    entry->color = color;
+    entry->bgcolor = bgcolor;
+    entry->speed = speed;
+    entry->font = font;
+    entry->priority = priority;
+    entry->repeat = MAX(repeat, 1);
+    entry->ttl = ttl;
+    entry->expires = now + ttl;
+    entry->seq = queue_seq++;
+
+    (void)pthread_mutex_unlock(&queue_mutex);
+
+    loop_wakeup();
+
+    return true;
+}
+
+// Shows the next queued announcement, the caller checks that nothing else is on
+bool announce_show_next(void)
+{
+    struct announcement next;
+    struct announcement *entry = NULL;
+    size_t i;
+
+    if (pthread_mutex_lock(&queue_mutex) != 0)
+        return false;
+
+    expire_announcements(get_monotonic_time());
+
+    for (i = 0; i < ARRAY_LENGTH(queue); i++) {
+        if (queue[i].used && (! entry || queue[i].priority > entry->priority ||
+                              (queue[i].priority == entry->priority && queue[i].seq < entry->seq))) {
+            entry = &queue[i];
+        }
+    }
+
+    if (! entry) {
+        (void)pthread_mutex_unlock(&queue_mutex);
+        return false;
+    }
+
+    // Repeated ones go to the back of their priority and wait again
+    next = *entry;
+    if (entry->repeat > 1) {
+        entry->repeat--;
+        entry->expires = get_monotonic_time() + entry->ttl;
+        entry->seq = queue_seq++;
+    } else {
+        entry->used = false;
+    }
+
+    (void)pthread_mutex_unlock(&queue_mutex);
+
+    fprintf(stderr, "announcing text: %s\n", next.text);
+    set_announce_text(next.text, next.color, next.bgcolor, next.speed, next.font);
+    announce_game.activate_func(true);
+
+    return true;
+}
+
+unsigned long announce_dropped(void)
+{
+    return queue_dropped + queue_expired;
+}
+
 // https://github.com/dhepper/font8x8
 static const char *get_font8x8(wchar_t ch)
 {
@@ -187,11 +352,22 @@ static void input(int player, int key_idx, bool key_val, int key_state)
 
 static bool get_glyph_pix(const char *glyph, int y, int x)
 {
+    unsigned char row;
+    int bit;
+
     if (grid_widescreen) {
-        return (glyph[y] >> x) & 1;
+        row = glyph[y];
+        bit = x;
     } else {
-        return (glyph[(FONT_SIZE - 1) - x] >> y) & 1;
+        row = glyph[(FONT_SIZE - 1) - x];
+        bit = y;
     }
+
+    // Every pixel doubled to the right
+    if (announce_font == ANNOUNCE_FONT_BOLD)
+        row |= row << 1;
+
+    return (row >> bit) & 1;
 }
 
 static void draw(char *screen)
@@ -279,4 +455,5 @@ const struct game announce_game = {
     tick,
     render,
     idle,
+    false,
 };
@@ -277,4 +277,5 @@ const struct game breakout_game = {
     tick,
     render,
     idle,
+    false,
 };
@@ -0,0 +1,197 @@
+/* persisted WLED controller cache */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "matelight.h"
+
+/*
+ * The cache file holds a single line:
+ *
+ *   <address> <unix time of verification> <wled_ds>
+ *
+ * It is replaced atomically by writing a temporary file and renaming it.
+ * The fsync on an SD card can take a while, so the file is written by a
+ * thread of its own. Callers only leave the address, the newest one wins.
+ */
+
+static const char *cache_file = NULL;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t cache_thread;
+static bool cache_running = false;
+static char cache_address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)] = { 0 };
+static char cache_pending[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)] = { 0 };
+
+static bool write_cache(const char *address)
+{
+    char tmp_file[PATH_MAX];
+    char line[256 + MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+    int fd;
+    int len;
+    bool ok;
+
+    len = snprintf(line, sizeof(line), "%s %lld %s\n", address, (long long)time(NULL), wled_ds);
+    if (len < 0 || (size_t)len >= sizeof(line))
+        return false;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", cache_file);
+    fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(tmp_file);
+        return false;
+    }
+
+    ok = write(fd, line, len) == len && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (! ok || rename(tmp_file, cache_file) != 0) {
+        perror(cache_file);
+        (void)unlink(tmp_file);
+        return false;
+    }
+
+    fprintf(stderr, "cache: stored controller %s\n", address);
+    return true;
+}
+
+static void *cache_thread_func(void *arg)
+{
+    char address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+
+    (void)arg;
+
+    for (;;) {
+        if (pthread_mutex_lock(&cache_mutex) != 0)
+            return NULL;
+
+        while (! *cache_pending)
+            (void)pthread_cond_wait(&cache_cond, &cache_mutex);
+
+        memcpy(address, cache_pending, sizeof(address));
+        *cache_pending = '\0';
+
+        (void)pthread_mutex_unlock(&cache_mutex);
+
+        if (! write_cache(address))
+            continue;
+
+        if (pthread_mutex_lock(&cache_mutex) != 0)
+            return NULL;
+        memcpy(cache_address, address, sizeof(cache_address));
+        (void)pthread_mutex_unlock(&cache_mutex);
+    }
+
+    return NULL;
+}
+
+void controller_cache_init(const char *path)
+{
+    cache_file = (path && *path) ? path : NULL;
+    if (! cache_file)
+        return;
+
+    if (pthread_create(&cache_thread, NULL, cache_thread_func, NULL) != 0) {
+        perror("pthread_create");
+        fprintf(stderr, "cache: %s: not storing controllers\n", cache_file);
+        return;
+    }
+
+    (void)pthread_detach(cache_thread);
+    cache_running = true;
+}
+
+bool controller_cache_load(char *address, size_t size)
+{
+    FILE *fp;
+    char line[256 + MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+    char addr[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+    long long timestamp;
+    int ds_off = 0;
+    size_t len;
+
+    if (! cache_file || ! wled_ds)
+        return false;
+
+    fp = fopen(cache_file, "r");
+    if (! fp) {
+        if (errno != ENOENT)
+            perror(cache_file);
+        return false;
+    }
+
+    if (! fgets(line, sizeof(line), fp)) {
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+
+    if (sscanf(line, "%45s %lld %n", addr, &timestamp, &ds_off) != 2 || ds_off == 0) {
+        fprintf(stderr, "cache: %s: invalid format\n", cache_file);
+        return false;
+    }
+
+    // Only trust an address which was verified against the WLED we are looking for now
+    if (strcmp(line + ds_off, wled_ds) != 0) {
+        fprintf(stderr, "cache: %s: cached controller is not %s\n", cache_file, wled_ds);
+        return false;
+    }
+
+    fprintf(stderr, "cache: cached controller %s, verified %lld seconds ago\n", addr, (long long)time(NULL) - timestamp);
+
+    if (pthread_mutex_lock(&cache_mutex) == 0) {
+        memcpy(cache_address, addr, sizeof(cache_address));
+        (void)pthread_mutex_unlock(&cache_mutex);
+    }
+
+    strncpy(address, addr, size);
+    address[size - 1] = '\0';
+
+    return true;
+}
+
+bool controller_cache_address(char *address, size_t size)
+{
+    bool found = false;
+
+    if (pthread_mutex_lock(&cache_mutex) != 0)
+        return false;
+
+    if (*cache_address) {
+        strncpy(address, cache_address, size);
+        address[size - 1] = '\0';
+        found = true;
+    }
+
+    (void)pthread_mutex_unlock(&cache_mutex);
+
+    return found;
+}
+
+void controller_cache_store(const char *address)
+{
+    if (! cache_running || ! wled_ds || ! address || ! *address)
+        return;
+
+    if (pthread_mutex_lock(&cache_mutex) != 0)
+        return;
+
+    // Spare the SD card, only write when something changed
+    if (strcmp(cache_address, address) != 0 || *cache_pending) {
+        strncpy(cache_pending, address, sizeof(cache_pending) - 1);
+        (void)pthread_cond_signal(&cache_cond);
+    }
+
+    (void)pthread_mutex_unlock(&cache_mutex);
+}
@@ -151,6 +151,52 @@ class FifoJoypad:
         self.queue.put(struct.pack('IhBB', int(time.time()), 1 if value else 0, JS_EVENT_BUTTON, number))
 
 
+# Network gamepad protocol, see netinput.c
+class NetJoypad:
+    KEYS = {
+        ('axis', 0, -1): 0, ('axis', 0, 1): 1, ('axis', 1, -1): 2, ('axis', 1, 1): 3,
+        ('button', 8): 4, ('button', 9): 5, ('button', 0): 6, ('button', 1): 7,
+    }
+
+    def __init__(self, address, port, pad=0):
+        self.address = (address, port)
+        self.pad = pad
+        self.sock = socket.socket(family=socket.AF_INET, type=socket.SOCK_DGRAM)
+        self.queue = queue.Queue()
+        self.seq = int(time.time())
+        self.axes = {}
+
+    def send(self, events):
+        self.seq = (self.seq + 1) & 0xffffffff
+        data = struct.pack('>ccBBI', b'M', b'J', 1, len(events), self.seq)
+        for op in events:
+            data += struct.pack('BB', self.pad, op)
+        self.sock.sendto(data, self.address)
+
+    def fifo_writer(self):
+        self.send([0x40])
+        while True:
+            events = [self.queue.get()]
+            # Batch everything which is already pending into one packet
+            while not self.queue.empty() and len(events) < 255:
+                events.append(self.queue.get())
+            self.send(events)
+
+    def axis(self, number, value):
+        direction = -1 if value < 0 else (1 if value > 0 else 0)
+        old = self.axes.get(number, 0)
+        if old:
+            self.queue.put(self.KEYS[('axis', number, old)])
+        if direction:
+            self.queue.put(0x80 | self.KEYS[('axis', number, direction)])
+        self.axes[number] = direction
+
+    def button(self, number, value):
+        key = self.KEYS.get(('button', number))
+        if key is not None:
+            self.queue.put((0x80 if value else 0x00) | key)
+
+
 class Window:
     def __init__(self, wled, joypad):
         self.wled = wled
@@ -309,6 +355,7 @@ parser.add_argument('--height', help='Grid height', type=int, default=DEFAULT_HE
 parser.add_argument('--address', help='Listen address', default='127.0.0.1')
 parser.add_argument('--port', help='Listen port', type=int, default=UDP_PORT)
 parser.add_argument('--fifo', help='Joypad FIFO')
+parser.add_argument('--net-input', help='Matelight network input address, host:port')
 args = parser.parse_args()
 
 sock = socket.socket(family=socket.AF_INET, type=socket.SOCK_DGRAM)
@@ -317,7 +364,10 @@ sock.bind((args.address, args.port))
 if args.fifo and not os.path.exists(args.fifo):
     os.mkfifo(args.fifo)
 
-if args.fifo and os.path.exists(args.fifo):
+if args.net_input:
+    host, _, port = args.net_input.rpartition(':')
+    joypad = NetJoypad(host, int(port))
+elif args.fifo and os.path.exists(args.fifo):
     joypad = FifoJoypad(args.fifo)
 else:
     joypad = FifoJoypad()
@@ -0,0 +1,135 @@
+/* matelight shared framebuffer client */
+
+#ifndef MATELIGHT_FB_H
+#define MATELIGHT_FB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+/*
+ * matelight --framebuffer=PATH creates PATH (e.g. /dev/shm/matelight) holding
+ * a struct matelight_fb and listens on PATH.sock, which hands out the eventfd
+ * to signal new frames to every client that connects.
+ *
+ * Frames are published with a sequence lock: the sequence number is odd
+ * while the producer writes pixels, matelight only takes frames it read
+ * between two equal even sequence numbers. Pixels are RGB, row by row,
+ * width * height of them are shown. Frames are shown until the producer
+ * stops for MATELIGHT_FB_TIMEOUT_MS, games being played come first.
+ *
+ *   struct matelight_fb *fb;
+ *   int event_fd;
+ *
+ *   if (matelight_fb_open("/dev/shm/matelight", &fb, &event_fd) != 0)
+ *       return -1;
+ *   for (;;) {
+ *       matelight_fb_begin(fb);
+ *       draw(fb->pixels, fb->width, fb->height);
+ *       matelight_fb_end(fb, event_fd);
+ *       usleep(33333);
+ *   }
+ *
+ * Producers without atomics (scripts) can do the same with plain stores:
+ * write seq + 1, the pixels and seq + 2, the eventfd is optional since
+ * matelight checks the sequence number on every frame anyway.
+ */
+
+#define MATELIGHT_FB_MAGIC          0x42464c4d  /* "MLFB" */
+#define MATELIGHT_FB_VERSION        1
+#define MATELIGHT_FB_MAX_PIXELS     (32 * 32)
+#define MATELIGHT_FB_TIMEOUT_MS     2000
+
+struct matelight_fb {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;             /* grid size, set by matelight */
+    uint32_t height;
+    uint32_t seq;               /* odd while a frame is written */
+    uint32_t reserved[3];
+    uint8_t pixels[MATELIGHT_FB_MAX_PIXELS * 3];
+};
+
+/* Returns 0 on success, event_fd is -1 if matelight could not be reached */
+static inline int matelight_fb_open(const char *path, struct matelight_fb **fb, int *event_fd)
+{
+    struct sockaddr_un addr = { 0 };
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    char byte;
+    struct iovec iov = { &byte, sizeof(byte) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    void *map;
+    int fd;
+
+    *event_fd = -1;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    map = mmap(NULL, sizeof(**fb), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    *fb = (struct matelight_fb *)map;
+    if ((*fb)->magic != MATELIGHT_FB_MAGIC || (*fb)->version != MATELIGHT_FB_VERSION) {
+        munmap(map, sizeof(**fb));
+        return -1;
+    }
+
+    // Frames still get picked up without the eventfd, just not right away
+    if (strlen(path) + sizeof(".sock") > sizeof(addr.sun_path))
+        return 0;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path));
+    strcat(addr.sun_path, ".sock");
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return 0;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) > 0) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(event_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    close(fd);
+
+    return 0;
+}
+
+static inline void matelight_fb_begin(struct matelight_fb *fb)
+{
+    __atomic_store_n(&fb->seq, fb->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void matelight_fb_end(struct matelight_fb *fb, int event_fd)
+{
+    __atomic_store_n(&fb->seq, fb->seq + 1, __ATOMIC_RELEASE);
+    if (event_fd != -1)
+        (void)eventfd_write(event_fd, 1);
+}
+
+static inline void matelight_fb_close(struct matelight_fb *fb, int event_fd)
+{
+    munmap(fb, sizeof(*fb));
+    if (event_fd != -1)
+        close(event_fd);
+}
+
+#endif
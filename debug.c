@@ -131,4 +131,5 @@ const struct game debug_game = {
     tick,
     render,
     idle,
+    false,
 };
@@ -222,4 +222,5 @@ const struct game flappy_game = {
     tick,
     render,
     idle,
+    false,
 };
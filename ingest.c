@@ -0,0 +1,494 @@
+/* external frame streams (WLED UDP realtime and DDP) */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "matelight.h"
+
+/*
+ * One UDP port takes both protocols, told apart by the first byte:
+ *
+ *   WLED realtime: 2 (DRGB), 3 (DRGBW) or 4 (DNRGB) followed by the timeout
+ *                  in seconds (255: no timeout), DNRGB adds a 16 bit big
+ *                  endian start index
+ *   DDP:           version 1 (0x40) in the top bits, push flag in bit 0,
+ *                  destination 1 (display), 32 bit byte offset and 16 bit
+ *                  length, all big endian
+ *
+ * Datagrams are received in batches straight into packet slots, a frame is
+ * the list of slots holding its pixels until it is replaced by the next one.
+ * The first sender with a complete frame holds the wall until it times out,
+ * then the next one takes over. Players and announcements come first.
+ */
+
+#define WLED_PROTO_DRGB             2
+#define WLED_PROTO_DRGBW            3
+#define WLED_PROTO_DNRGB            4
+#define WLED_NO_TIMEOUT             255
+
+#define DDP_HEADER_SIZE             10
+#define DDP_TIMECODE_SIZE           4
+#define DDP_VERSION_MASK            0xc0
+#define DDP_VERSION_1               0x40
+#define DDP_FLAG_TIMECODE           0x10
+#define DDP_FLAG_PUSH               0x01
+#define DDP_TYPE_RGBW               0x18
+#define DDP_ID_DISPLAY              1
+
+#define INGEST_MAX_SOURCES          4
+#define INGEST_MAX_CHUNKS           16  /* packets per frame */
+#define INGEST_BATCH                16  /* datagrams per recvmmsg() */
+#define INGEST_MAX_BATCHES          8   /* per wakeup */
+#define INGEST_SLOT_SIZE            1500
+#define INGEST_SLOTS                ((INGEST_MAX_SOURCES * 2 * INGEST_MAX_CHUNKS) + INGEST_BATCH)
+
+#define INGEST_DDP_TIMEOUT          2.0
+#define INGEST_MAX_TIMEOUT          3600.0
+
+struct ingest_chunk {
+    int slot;
+    unsigned int data_off;
+    unsigned int pixel;
+    unsigned int count;
+    unsigned int bpp;
+};
+
+struct ingest_frame {
+    struct ingest_chunk chunks[INGEST_MAX_CHUNKS];
+    int num_chunks;
+};
+
+struct ingest_source {
+    bool used;
+    struct sockaddr_storage addr;
+    const char *proto;
+    double first_seen;
+    double last_seen;
+    double timeout;
+    struct ingest_frame shown;
+    struct ingest_frame pending;
+    unsigned long frames;
+};
+
+static int ingest_fd = -1;
+static unsigned char slots[INGEST_SLOTS][INGEST_SLOT_SIZE];
+static int free_slots[INGEST_SLOTS];
+static int num_free_slots = 0;
+static struct ingest_source sources[INGEST_MAX_SOURCES] = { 0 };
+static struct ingest_source *holder = NULL;
+
+static unsigned long dropped_packets = 0;
+static unsigned long dropped_frames = 0;
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static bool same_addr(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+
+    return a->ss_family == AF_INET && b->ss_family == AF_INET &&
+           a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+static void format_addr(const struct sockaddr_storage *addr, char *buf, size_t size)
+{
+    char host[INET_ADDRSTRLEN] = { 0 };
+
+    (void)inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, host, sizeof(host));
+    snprintf(buf, size, "%s:%d", host, ntohs(((const struct sockaddr_in *)addr)->sin_port));
+}
+
+static void release_slot(int slot)
+{
+    free_slots[num_free_slots++] = slot;
+}
+
+static void frame_clear(struct ingest_frame *frame)
+{
+    int i;
+
+    for (i = 0; i < frame->num_chunks; i++) {
+        release_slot(frame->chunks[i].slot);
+    }
+    frame->num_chunks = 0;
+}
+
+static void remove_source(struct ingest_source *source, const char *reason)
+{
+    char name[32];
+
+    format_addr(&source->addr, name, sizeof(name));
+    fprintf(stderr, "ingest: %s source %s %s after %lu frames\n", source->proto, name, reason, source->frames);
+
+    frame_clear(&source->shown);
+    frame_clear(&source->pending);
+    source->used = false;
+    if (holder == source)
+        holder = NULL;
+}
+
+static void expire_sources(double now)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(sources); i++) {
+        if (sources[i].used && (now - sources[i].last_seen) >= sources[i].timeout) {
+            remove_source(&sources[i], "timed out");
+        }
+    }
+}
+
+static struct ingest_source *get_source(const struct sockaddr_storage *addr, const char *proto, double now)
+{
+    size_t i;
+    struct ingest_source *source = NULL;
+    char name[32];
+
+    for (i = 0; i < ARRAY_LENGTH(sources); i++) {
+        if (sources[i].used && same_addr(&sources[i].addr, addr))
+            return &sources[i];
+        if (! sources[i].used && ! source)
+            source = &sources[i];
+    }
+
+    if (! source) {
+        // Make room if somebody stopped sending without us noticing yet
+        expire_sources(now);
+        for (i = 0; i < ARRAY_LENGTH(sources) && ! source; i++) {
+            if (! sources[i].used)
+                source = &sources[i];
+        }
+        if (! source)
+            return NULL;
+    }
+
+    memset(source, '\0', sizeof(*source));
+    source->used = true;
+    memcpy(&source->addr, addr, sizeof(*addr));
+    source->proto = proto;
+    source->first_seen = now;
+    source->last_seen = now;
+    source->timeout = INGEST_DDP_TIMEOUT;
+
+    format_addr(addr, name, sizeof(name));
+    fprintf(stderr, "ingest: new %s source %s\n", proto, name);
+
+    return source;
+}
+
+static void frame_publish(struct ingest_source *source, double now)
+{
+    if (source->pending.num_chunks == 0)
+        return;
+
+    frame_clear(&source->shown);
+    source->shown = source->pending;
+    source->pending.num_chunks = 0;
+    source->frames++;
+    source->last_seen = now;
+}
+
+// Takes over the slot unless the frame is full
+static bool frame_add(struct ingest_source *source, const struct ingest_chunk *chunk)
+{
+    if (source->pending.num_chunks >= INGEST_MAX_CHUNKS) {
+        frame_clear(&source->pending);
+        dropped_frames++;
+        return false;
+    }
+
+    source->pending.chunks[source->pending.num_chunks++] = *chunk;
+    return true;
+}
+
+static bool handle_wled(int slot, size_t len, const struct sockaddr_storage *addr, double now)
+{
+    const unsigned char *data = slots[slot];
+    struct ingest_source *source;
+    struct ingest_chunk chunk = { 0 };
+    size_t header = 2;
+    unsigned int grid_leds = grid_width * grid_height;
+    bool kept;
+
+    if (data[0] == WLED_PROTO_DNRGB) {
+        header = 4;
+        chunk.pixel = (data[2] << 8) | data[3];
+    }
+    if (len <= header)
+        return false;
+
+    chunk.slot = slot;
+    chunk.data_off = header;
+    chunk.bpp = data[0] == WLED_PROTO_DRGBW ? 4 : 3;
+    chunk.count = (len - header) / chunk.bpp;
+    if (chunk.count == 0 || chunk.pixel >= grid_leds)
+        return false;
+
+    source = get_source(addr, "WLED", now);
+    if (! source)
+        return false;
+    source->timeout = data[1] == WLED_NO_TIMEOUT ? INGEST_MAX_TIMEOUT : MAX(data[1], 1);
+
+    // DNRGB frames end at the end of the grid or when the next one starts
+    if (chunk.pixel == 0)
+        frame_publish(source, now);
+    kept = frame_add(source, &chunk);
+    if (data[0] != WLED_PROTO_DNRGB || chunk.pixel + chunk.count >= grid_leds)
+        frame_publish(source, now);
+
+    return kept;
+}
+
+static bool handle_ddp(int slot, size_t len, const struct sockaddr_storage *addr, double now)
+{
+    const unsigned char *data = slots[slot];
+    struct ingest_source *source;
+    struct ingest_chunk chunk = { 0 };
+    size_t header = DDP_HEADER_SIZE;
+    unsigned int grid_leds = grid_width * grid_height;
+    uint32_t offset;
+    uint16_t data_len;
+    bool kept;
+
+    if (data[0] & DDP_FLAG_TIMECODE)
+        header += DDP_TIMECODE_SIZE;
+    if (len < header || data[3] != DDP_ID_DISPLAY)
+        return false;
+
+    memcpy(&offset, &data[4], sizeof(offset));
+    memcpy(&data_len, &data[8], sizeof(data_len));
+    offset = ntohl(offset);
+    data_len = ntohs(data_len);
+    if (data_len > len - header)
+        return false;
+
+    chunk.slot = slot;
+    chunk.data_off = header;
+    chunk.bpp = (data[2] & 0x38) == DDP_TYPE_RGBW ? 4 : 3;
+    chunk.pixel = offset / chunk.bpp;
+    chunk.count = data_len / chunk.bpp;
+
+    source = get_source(addr, "DDP", now);
+    if (! source)
+        return false;
+    source->timeout = INGEST_DDP_TIMEOUT;
+
+    // A push only packet (no data) completes the frame as well
+    kept = false;
+    if (chunk.count > 0 && chunk.pixel < grid_leds) {
+        if (chunk.pixel == 0)
+            frame_publish(source, now);
+        kept = frame_add(source, &chunk);
+    }
+    if ((data[0] & DDP_FLAG_PUSH) || chunk.pixel + chunk.count >= grid_leds)
+        frame_publish(source, now);
+
+    return kept;
+}
+
+// Returns true if the slot now belongs to a frame
+static bool handle_datagram(int slot, size_t len, const struct sockaddr_storage *addr, double now)
+{
+    const unsigned char *data = slots[slot];
+
+    if (len < 2 || addr->ss_family != AF_INET)
+        return false;
+
+    if (data[0] == WLED_PROTO_DRGB || data[0] == WLED_PROTO_DRGBW || data[0] == WLED_PROTO_DNRGB)
+        return handle_wled(slot, len, addr, now);
+
+    if ((data[0] & DDP_VERSION_MASK) == DDP_VERSION_1)
+        return handle_ddp(slot, len, addr, now);
+
+    return false;
+}
+
+static void ingest_func(int fd, unsigned int events, void *arg)
+{
+    struct mmsghdr msgs[INGEST_BATCH];
+    struct iovec iovs[INGEST_BATCH];
+    struct sockaddr_storage addrs[INGEST_BATCH];
+    int batch_slots[INGEST_BATCH];
+    int i, n, received, batch;
+    double now;
+
+    (void)events;
+    (void)arg;
+
+    for (batch = 0; batch < INGEST_MAX_BATCHES; batch++) {
+        // Frames hold at most their own slots twice over, so a batch always fits
+        n = MIN(num_free_slots, INGEST_BATCH);
+        if (n == 0)
+            break;
+
+        memset(msgs, '\0', sizeof(msgs[0]) * n);
+        for (i = 0; i < n; i++) {
+            batch_slots[i] = free_slots[--num_free_slots];
+            iovs[i].iov_base = slots[batch_slots[i]];
+            iovs[i].iov_len = INGEST_SLOT_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        received = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvmmsg");
+            received = 0;
+        }
+
+        now = get_monotonic_time();
+        for (i = 0; i < received; i++) {
+            if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || ! handle_datagram(batch_slots[i], msgs[i].msg_len, &addrs[i], now)) {
+                dropped_packets++;
+                release_slot(batch_slots[i]);
+            }
+        }
+        for (i = received; i < n; i++) {
+            release_slot(batch_slots[i]);
+        }
+
+        if (received < n)
+            break;
+    }
+}
+
+static struct ingest_source *get_holder(void)
+{
+    size_t i;
+    struct ingest_source *next = NULL;
+    char name[32];
+
+    expire_sources(get_monotonic_time());
+
+    if (holder)
+        return holder;
+
+    // First come, first served
+    for (i = 0; i < ARRAY_LENGTH(sources); i++) {
+        if (sources[i].used && sources[i].frames > 0 && (! next || sources[i].first_seen < next->first_seen))
+            next = &sources[i];
+    }
+
+    if (next) {
+        holder = next;
+        format_addr(&holder->addr, name, sizeof(name));
+        fprintf(stderr, "ingest: showing %s source %s\n", holder->proto, name);
+    }
+
+    return holder;
+}
+
+static void render(bool *display, char *screen)
+{
+    struct ingest_source *source = get_holder();
+    const struct ingest_chunk *chunk;
+    const unsigned char *data;
+    unsigned int grid_leds = grid_width * grid_height;
+    unsigned int count, j;
+    int i;
+
+    if (! source) {
+        *display = false;
+        return;
+    }
+
+    memset(screen, '\0', grid_leds * 3);
+    for (i = 0; i < source->shown.num_chunks; i++) {
+        chunk = &source->shown.chunks[i];
+        if (chunk->pixel >= grid_leds)
+            continue;
+        data = slots[chunk->slot] + chunk->data_off;
+        count = MIN(chunk->count, grid_leds - chunk->pixel);
+        if (chunk->bpp == 3) {
+            memcpy(screen + (chunk->pixel * 3), data, count * 3);
+        } else {
+            // The white channel has nowhere to go
+            for (j = 0; j < count; j++) {
+                memcpy(screen + ((chunk->pixel + j) * 3), data + (j * 4), 3);
+            }
+        }
+    }
+
+    *display = true;
+}
+
+static bool idle(void)
+{
+    return get_holder() == NULL;
+}
+
+unsigned long frame_ingest_dropped(void)
+{
+    return dropped_packets + dropped_frames;
+}
+
+void frame_ingest_init(int port)
+{
+    struct sockaddr_in addr = { 0 };
+    int opt;
+    int i;
+
+    for (i = 0; i < INGEST_SLOTS; i++) {
+        release_slot(i);
+    }
+
+    ingest_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ingest_fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    opt = 1;
+    (void)setsockopt(ingest_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(ingest_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (! loop_add_fd(ingest_fd, EPOLLIN, ingest_func, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "ingest: listening on udp port %d\n", port);
+}
+
+const struct game ingest_game = {
+    "ingest",
+    false,
+    false,
+    0.1,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    render,
+    idle,
+    true,
+};
@@ -1,5 +1,6 @@
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,18 +9,225 @@
 #include <poll.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <linux/limits.h>
 #include <linux/joystick.h>
 #include <libudev.h>
 #include <termios.h>
+#include <pthread.h>
 
 #include "matelight.h"
 
+// Open addressing with linear probing, twice the joystick table so probes stay short
+#define JOYSTICK_INDEX_SIZE (MAX_JOYSTICKS * 2)
+
+#define PLAYER_MAP_BITS     64
+
+// Per frame input budget, whatever is left is picked up in the next frame
+#define MAX_FRAME_EVENTS    32  /* events handed to the games */
+#define MAX_FRAME_READS     256 /* raw events including coalesced ones */
+
+#define JS_EVENT_BUFFER     16
+
+struct joystick_index {
+    unsigned char slots[JOYSTICK_INDEX_SIZE];  // joystick table index + 1, 0 = empty
+    unsigned int (*hash)(const struct joystick *joystick);
+};
+
+struct js_event_buffer {
+    struct js_event events[JS_EVENT_BUFFER];
+    unsigned int pos;
+    unsigned int count;
+};
+
 static struct joystick joysticks[MAX_JOYSTICKS] = { 0 };
+static struct js_event_buffer js_event_buffers[MAX_JOYSTICKS] = { 0 };
 static size_t num_joysticks = 0;
+static size_t next_joystick = 0;
+static int active_joysticks = 0;
+static uint64_t player_map = 0;  // bit (player - 1) is set when the player is taken
+
+static unsigned int hash_dev(dev_t dev)
+{
+    uint64_t h = (uint64_t)dev * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(h >> 32);
+}
+
+static unsigned int hash_devnode(const char *devnode)
+{
+    // FNV-1a
+    unsigned int h = 2166136261U;
+
+    while (*devnode) {
+        h ^= (unsigned char)*devnode++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static unsigned int joystick_hash_dev(const struct joystick *joystick)
+{
+    return hash_dev(joystick->dev);
+}
+
+static unsigned int joystick_hash_devnode(const struct joystick *joystick)
+{
+    return hash_devnode(joystick->devnode);
+}
+
+static struct joystick_index dev_index = { { 0 }, joystick_hash_dev };
+static struct joystick_index devnode_index = { { 0 }, joystick_hash_devnode };
+
+static void index_insert(struct joystick_index *index, struct joystick *joystick)
+{
+    size_t i;
+
+    i = index->hash(joystick) % JOYSTICK_INDEX_SIZE;
+    while (index->slots[i])
+        i = (i + 1) % JOYSTICK_INDEX_SIZE;
+
+    index->slots[i] = (joystick - joysticks) + 1;
+}
+
+static void index_remove(struct joystick_index *index, struct joystick *joystick)
+{
+    size_t i, j, home;
+
+    i = index->hash(joystick) % JOYSTICK_INDEX_SIZE;
+    while (index->slots[i] && &joysticks[index->slots[i] - 1] != joystick)
+        i = (i + 1) % JOYSTICK_INDEX_SIZE;
+
+    if (! index->slots[i])
+        return;
+
+    // Backward shift deletion, no tombstones
+    index->slots[i] = 0;
+    j = i;
+    for (;;) {
+        j = (j + 1) % JOYSTICK_INDEX_SIZE;
+        if (! index->slots[j])
+            break;
+
+        home = index->hash(&joysticks[index->slots[j] - 1]) % JOYSTICK_INDEX_SIZE;
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        index->slots[i] = index->slots[j];
+        index->slots[j] = 0;
+        i = j;
+    }
+}
+
+static struct joystick *find_joystick_by_dev(dev_t dev)
+{
+    size_t i;
+    struct joystick *joystick;
+
+    i = hash_dev(dev) % JOYSTICK_INDEX_SIZE;
+    while (dev_index.slots[i]) {
+        joystick = &joysticks[dev_index.slots[i] - 1];
+        if (joystick->dev == dev)
+            return joystick;
+        i = (i + 1) % JOYSTICK_INDEX_SIZE;
+    }
+
+    return NULL;
+}
+
+static struct joystick *find_joystick_by_devnode(const char *devnode)
+{
+    size_t i;
+    struct joystick *joystick;
+
+    i = hash_devnode(devnode) % JOYSTICK_INDEX_SIZE;
+    while (devnode_index.slots[i]) {
+        joystick = &joysticks[devnode_index.slots[i] - 1];
+        if (strcmp(joystick->devnode, devnode) == 0)
+            return joystick;
+        i = (i + 1) % JOYSTICK_INDEX_SIZE;
+    }
+
+    return NULL;
+}
+
+static int frame_events = 0;
+static int frame_reads = 0;
+static bool joysticks_parked = false;
+
+// Called once all fields of a newly opened joystick are set
+static void attach_joystick(struct joystick *joystick)
+{
+    if (joystick->player >= 1 && joystick->player <= PLAYER_MAP_BITS)
+        player_map |= (uint64_t)1 << (joystick->player - 1);
+
+    if (joystick->type == INPUT_JOYSTICK)
+        index_insert(&dev_index, joystick);
+    index_insert(&devnode_index, joystick);
+
+    js_event_buffers[joystick - joysticks].pos = 0;
+    js_event_buffers[joystick - joysticks].count = 0;
+
+    // Network pads share one socket which is watched by netinput.c
+    if (joystick->type != INPUT_NETWORK)
+        (void)loop_add_fd(joystick->fd, joysticks_parked ? 0 : EPOLLIN, NULL, NULL);
+
+    active_joysticks++;
+}
+
+static void close_joystick(struct joystick *joystick)
+{
+    if (joystick->fd == -1)
+        return;
+
+    if (joystick->player >= 1 && joystick->player <= PLAYER_MAP_BITS)
+        player_map &= ~((uint64_t)1 << (joystick->player - 1));
+
+    if (joystick->type == INPUT_JOYSTICK)
+        index_remove(&dev_index, joystick);
+    index_remove(&devnode_index, joystick);
+
+    active_joysticks--;
 
+    if (joystick->type != INPUT_NETWORK)
+        loop_del_fd(joystick->fd);
+    if (joystick->type == INPUT_JOYSTICK)
+        close(joystick->fd);
+    joystick->fd = -1;
+}
+
+static struct input_stats stats = { 0 };
+
+#define UDEV_EVENT_ADD          0
+#define UDEV_EVENT_REMOVE       1
+#define UDEV_EVENT_CHANGE       2
+
+#define UDEV_EVENT_QUEUE_SIZE   16 /* must be a power of two */
+
+struct udev_event {
+    int action;
+    struct joystick joystick;
+};
+
+// Owned by the udev thread once it is started
 static struct udev *udev_ctx = NULL;
 static struct udev_monitor *udev_monitor = NULL;
+static pthread_t udev_thread;
+static dev_t udev_thread_devs[MAX_JOYSTICKS];
+static size_t num_udev_thread_devs = 0;
+
+// udev thread -> main loop
+static pthread_mutex_t udev_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t udev_cond = PTHREAD_COND_INITIALIZER;
+static struct udev_event udev_events[UDEV_EVENT_QUEUE_SIZE];
+static unsigned int udev_events_head = 0;
+static unsigned int udev_events_tail = 0;
+static int udev_event_fd = -1;
+
+// main loop -> udev thread, devices it handed over but which were not added
+static dev_t udev_rejected_devs[MAX_JOYSTICKS];
+static size_t num_udev_rejected_devs = 0;
 
 struct termios orig_termios = { 0 };
 static int stdin_flags = -1;
@@ -31,24 +239,9 @@ void input_reset(void)
     size_t i;
 
     for (i = 0; i < num_joysticks; i++) {
-        if (joysticks[i].fd != -1) {
-            if (joysticks[i].type == INPUT_JOYSTICK) {
-                close(joysticks[i].fd);
-            }
-            joysticks[i].fd = -1;
-        }
+        close_joystick(&joysticks[i]);
     }
     num_joysticks = 0;
-
-    if (udev_ctx != NULL) {
-        if (udev_monitor != NULL) {
-            udev_monitor_unref(udev_monitor);
-        }
-        udev_monitor = NULL;
-
-        udev_unref(udev_ctx);
-        udev_ctx = NULL;
-    }
 }
 
 struct joystick *get_free_joystick(void)
@@ -72,23 +265,14 @@ struct joystick *get_free_joystick(void)
 
 int get_available_player(void)
 {
-    size_t i;
-    int player = 1;
+    if (~player_map == 0)
+        return PLAYER_MAP_BITS + 1;
 
-    for (i = 0; i < num_joysticks; i++) {
-        if (joysticks[i].fd == -1)
-            continue;
-
-        if (joysticks[i].player == player) {
-            player++;
-            i = 0;
-        }
-    }
-
-    return player;
+    return __builtin_ctzll(~player_map) + 1;
 }
 
-bool open_joystick(const char *devnode, struct stat *st, bool check_joydev)
+// Opens and queries a joystick without touching the joystick table, safe to call from the udev thread
+static bool probe_joystick(const char *devnode, struct stat *st, bool check_joydev, struct joystick *probe)
 {
     int fd = -1;
     int opt = 0;
@@ -97,10 +281,8 @@ bool open_joystick(const char *devnode, struct stat *st, bool check_joydev)
     char buttons = 0;
     char name[128] = { 0 };
     int save_errno = 0;
-    struct joystick *joystick = NULL;
-    int player = 1;
 
-    fd = open(devnode, O_RDONLY);
+    fd = open(devnode, O_RDONLY | O_CLOEXEC);
     if (fd == -1) {
         return false;
     }
@@ -119,6 +301,7 @@ bool open_joystick(const char *devnode, struct stat *st, bool check_joydev)
             return false;
         }
         if (version == 0) {
+            close(fd);
             errno = EINVAL;
             return false;
         }
@@ -134,37 +317,68 @@ bool open_joystick(const char *devnode, struct stat *st, bool check_joydev)
     if (ioctl(fd, JSIOCGNAME(sizeof(name)), name) < 0)
         *name = '\0';
 
+    probe->type = INPUT_JOYSTICK;
+    probe->fd = fd;
+    strncpy(probe->devnode, devnode, sizeof(probe->devnode));
+    probe->devnode[sizeof(probe->devnode) - 1] = '\0';
+    probe->dev = st->st_rdev;
+
+    probe->axes = axes;
+    probe->buttons = buttons;
+    strncpy(probe->name, name, sizeof(probe->name));
+    probe->name[sizeof(probe->name) - 1] = '\0';
+
+    return true;
+}
+
+static bool add_probed_joystick(struct joystick *probe)
+{
+    struct joystick *joystick = NULL;
+    int player = 1;
+
     joystick = get_free_joystick();
     if (! joystick) {
-        close(fd);
+        close(probe->fd);
         errno = ENOMEM;
         return false;
     }
     player = get_available_player();
 
-    joystick->type = INPUT_JOYSTICK;
-    joystick->fd = fd;
-    strncpy(joystick->devnode, devnode, sizeof(joystick->devnode));
-    joystick->devnode[sizeof(joystick->devnode) - 1] = '\0';
-    joystick->dev = st->st_rdev;
+    joystick->type = probe->type;
+    joystick->fd = probe->fd;
+    memcpy(joystick->devnode, probe->devnode, sizeof(joystick->devnode));
+    joystick->dev = probe->dev;
 
-    joystick->axes = axes;
-    joystick->buttons = buttons;
-    strncpy(joystick->name, name, sizeof(joystick->name));
-    joystick->name[sizeof(joystick->name) - 1] = '\0';
+    joystick->axes = probe->axes;
+    joystick->buttons = probe->buttons;
+    memcpy(joystick->name, probe->name, sizeof(joystick->name));
 
     joystick->player = player;
+    joystick->net_pad = -1;
 
     joystick->key_state = 0;
     joystick->last_key_idx = KEYPAD_NONE;
     joystick->last_key_val = false;
-    memset(joysticks[num_joysticks].key_history, '\0', sizeof(joysticks[num_joysticks].key_history));
+    joystick->key_seq_state = 0;
+    joystick->key_seq_match = KEY_SEQ_NONE;
+
+    attach_joystick(joystick);
 
-    fprintf(stderr, "initialized joystick: %s, (player: %d, axes: %d, buttons: %d, name: %s)\n", devnode, player, axes, buttons, name);
+    fprintf(stderr, "initialized joystick: %s, (player: %d, axes: %d, buttons: %d, name: %s)\n", joystick->devnode, player, joystick->axes, joystick->buttons, joystick->name);
 
     return true;
 }
 
+bool open_joystick(const char *devnode, struct stat *st, bool check_joydev)
+{
+    struct joystick probe;
+
+    if (! probe_joystick(devnode, st, check_joydev, &probe))
+        return false;
+
+    return add_probed_joystick(&probe);
+}
+
 void init_joystick(const char *devnode)
 {
     struct stat st;
@@ -246,20 +460,138 @@ void init_keyboard(void)
     joystick->name[sizeof(joystick->name) - 1] = '\0';
 
     joystick->player = player;
+    joystick->net_pad = -1;
 
     joystick->key_state = 0;
     joystick->last_key_idx = KEYPAD_NONE;
     joystick->last_key_val = false;
-    memset(joysticks[num_joysticks].key_history, '\0', sizeof(joysticks[num_joysticks].key_history));
+    joystick->key_seq_state = 0;
+    joystick->key_seq_match = KEY_SEQ_NONE;
+
+    attach_joystick(joystick);
 
     fprintf(stderr, "initialized keyboard, (player: %d)\n", player);
 }
 
-static void add_udev_device(struct udev_device *dev)
+struct joystick *add_virtual_joystick(int type, int fd, const char *devnode, const char *name)
+{
+    struct joystick *joystick = NULL;
+
+    joystick = get_free_joystick();
+    if (! joystick) {
+        fprintf(stderr, "add_virtual_joystick: no free joystick for %s\n", devnode);
+        return NULL;
+    }
+
+    joystick->type = type;
+    joystick->fd = fd;
+    strncpy(joystick->devnode, devnode, sizeof(joystick->devnode));
+    joystick->devnode[sizeof(joystick->devnode) - 1] = '\0';
+    joystick->dev = -1;
+
+    joystick->axes = 2;
+    joystick->buttons = 4;
+    strncpy(joystick->name, name, sizeof(joystick->name));
+    joystick->name[sizeof(joystick->name) - 1] = '\0';
+
+    joystick->player = get_available_player();
+    joystick->net_pad = -1;
+
+    joystick->key_state = 0;
+    joystick->last_key_idx = KEYPAD_NONE;
+    joystick->last_key_val = false;
+    joystick->key_seq_state = 0;
+    joystick->key_seq_match = KEY_SEQ_NONE;
+
+    attach_joystick(joystick);
+
+    return joystick;
+}
+
+void remove_virtual_joystick(struct joystick *joystick)
+{
+    if (! joystick)
+        return;
+
+    close_joystick(joystick);
+}
+
+static void post_udev_event(int action, struct joystick *probe)
+{
+    struct udev_event *event;
+    uint64_t val = 1;
+
+    if (pthread_mutex_lock(&udev_mutex) != 0)
+        return;
+
+    while (udev_events_tail - udev_events_head >= UDEV_EVENT_QUEUE_SIZE) {
+        (void)pthread_cond_wait(&udev_cond, &udev_mutex);
+    }
+
+    event = &udev_events[udev_events_tail++ & (UDEV_EVENT_QUEUE_SIZE - 1)];
+    event->action = action;
+    memcpy(&event->joystick, probe, sizeof(event->joystick));
+
+    (void)pthread_mutex_unlock(&udev_mutex);
+
+    (void)write(udev_event_fd, &val, sizeof(val));
+}
+
+static bool udev_thread_has_dev(dev_t dev)
 {
     size_t i;
+
+    for (i = 0; i < num_udev_thread_devs; i++) {
+        if (udev_thread_devs[i] == dev)
+            return true;
+    }
+
+    return false;
+}
+
+static void udev_thread_forget_dev(dev_t dev)
+{
+    size_t i;
+
+    for (i = 0; i < num_udev_thread_devs; i++) {
+        if (udev_thread_devs[i] == dev) {
+            udev_thread_devs[i] = udev_thread_devs[--num_udev_thread_devs];
+            return;
+        }
+    }
+}
+
+static void udev_thread_forget_rejected(void)
+{
+    size_t i;
+
+    if (pthread_mutex_lock(&udev_mutex) != 0)
+        return;
+
+    for (i = 0; i < num_udev_rejected_devs; i++) {
+        udev_thread_forget_dev(udev_rejected_devs[i]);
+    }
+    num_udev_rejected_devs = 0;
+
+    (void)pthread_mutex_unlock(&udev_mutex);
+}
+
+static void udev_reject_dev(dev_t dev)
+{
+    if (pthread_mutex_lock(&udev_mutex) != 0)
+        return;
+
+    if (num_udev_rejected_devs < ARRAY_LENGTH(udev_rejected_devs))
+        udev_rejected_devs[num_udev_rejected_devs++] = dev;
+
+    (void)pthread_mutex_unlock(&udev_mutex);
+}
+
+static void add_udev_device(struct udev_device *dev, bool change)
+{
     const char *devnode;
     struct stat st;
+    struct joystick probe;
 
     if (! dev)
         return;
@@ -276,26 +608,39 @@ static void add_udev_device(struct udev_device *dev)
         return;
     }
 
-    for (i = 0; i < num_joysticks; i++) {
-        if (joysticks[i].fd == -1)
-            continue;
+    memset(&probe, '\0', sizeof(probe));
+
+    // So a device the main loop did not take is probed again
+    udev_thread_forget_rejected();
 
-        if (joysticks[i].dev == st.st_rdev) {
+    if (udev_thread_has_dev(st.st_rdev)) {
+        if (change) {
+            // Keep using the already opened fd
+            probe.fd = -1;
+            strncpy(probe.devnode, devnode, sizeof(probe.devnode) - 1);
+            probe.dev = st.st_rdev;
+            post_udev_event(UDEV_EVENT_CHANGE, &probe);
+        } else {
             fprintf(stderr, "add_udev_device: joystick %s allready opened\n", devnode);
-            return;
         }
+        return;
     }
 
-    if (! open_joystick(devnode, &st, true)) {
+    if (! probe_joystick(devnode, &st, true, &probe)) {
         fprintf(stderr, "add_udev_device: unable to open %s\n", devnode);
         return;
     }
+
+    if (num_udev_thread_devs < ARRAY_LENGTH(udev_thread_devs))
+        udev_thread_devs[num_udev_thread_devs++] = st.st_rdev;
+
+    post_udev_event(UDEV_EVENT_ADD, &probe);
 }
 
 static void remove_udev_device(struct udev_device *dev)
 {
-    size_t i;
     const char *devnode;
+    struct joystick probe;
 
     if (! dev)
         return;
@@ -307,19 +652,17 @@ static void remove_udev_device(struct udev_device *dev)
         return;
     }
 
-    for (i = 0; i < num_joysticks; i++) {
-        if (joysticks[i].fd == -1)
-            continue;
+    memset(&probe, '\0', sizeof(probe));
+    probe.fd = -1;
+    strncpy(probe.devnode, devnode, sizeof(probe.devnode) - 1);
+    probe.dev = udev_device_get_devnum(dev);
 
-        if (strcmp(joysticks[i].devnode, devnode) == 0) {
-            fprintf(stderr, "remove_udev_device: removed joystick %s\n", devnode);
-            close(joysticks[i].fd);
-            joysticks[i].fd = -1;
-        }
-    }
+    udev_thread_forget_dev(probe.dev);
+
+    post_udev_event(UDEV_EVENT_REMOVE, &probe);
 }
 
-void init_udev_hotplug(void)
+static void enumerate_udev_devices(void)
 {
     struct udev_enumerate *enumerate = NULL;
     struct udev_list_entry *devices = NULL;
@@ -327,35 +670,10 @@ void init_udev_hotplug(void)
     const char *name = NULL;
     struct udev_device *dev = NULL;
 
-    if (udev_ctx != NULL) {
-        if (udev_monitor != NULL) {
-            udev_monitor_unref(udev_monitor);
-        }
-        udev_monitor = NULL;
-
-        udev_unref(udev_ctx);
-        udev_ctx = NULL;
-    }
-
-    udev_ctx = udev_new();
-
-    if (! udev_ctx) {
-        fprintf(stderr, "init_udev_hotplug: unable to initialize udev.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    udev_monitor = udev_monitor_new_from_netlink(udev_ctx, "udev");
-    if (udev_monitor) {
-        udev_monitor_filter_add_match_subsystem_devtype(udev_monitor, "input", NULL);
-        udev_monitor_enable_receiving(udev_monitor);
-    } else {
-        fprintf(stderr, "init_udev_hotplug: unable to initialize udev monitor.\n");
-    }
-
     enumerate = udev_enumerate_new(udev_ctx);
     if (! enumerate) {
         fprintf(stderr, "init_udev_hotplug: unable to initialize udev enumeration.\n");
-        exit(EXIT_FAILURE);
+        return;
     }
 
     udev_enumerate_add_match_property(enumerate, "ID_INPUT_JOYSTICK", "1");
@@ -368,7 +686,7 @@ void init_udev_hotplug(void)
         if (name) {
             dev = udev_device_new_from_syspath(udev_ctx, name);
             if (dev) {
-                add_udev_device(dev);
+                add_udev_device(dev, false);
                 udev_device_unref(dev);
             }
         }
@@ -377,28 +695,31 @@ void init_udev_hotplug(void)
     udev_enumerate_unref(enumerate);
 }
 
-static void udev_monitor_poll(void)
+static void *udev_thread_func(void *arg)
 {
     struct pollfd fds[1];
-    int ret;
     struct udev_device *dev;
     const char *val;
     const char *action;
 
-    if (udev_ctx == NULL || udev_monitor == NULL)
-        return;
+    (void)arg;
+
+    // Enumerate after the monitor is set up so no device added in between gets lost
+    enumerate_udev_devices();
+
+    if (udev_monitor == NULL)
+        return NULL;
 
     for (;;) {
         fds[0].fd = udev_monitor_get_fd(udev_monitor);
         fds[0].events = POLLIN;
         fds[0].revents = 0;
 
-        ret = poll(fds, ARRAY_LENGTH(fds), 0);
-        if (ret != 1)
-            return;
+        if (poll(fds, ARRAY_LENGTH(fds), -1) != 1)
+            continue;
 
         if ((fds[0].revents & POLLIN) == 0)
-            return;
+            continue;
 
         dev = udev_monitor_receive_device(udev_monitor);
         if (dev) {
@@ -407,18 +728,113 @@ static void udev_monitor_poll(void)
 
             if (val && strcmp(val, "1") == 0 && action) {
                 if (strcmp(action, "add") == 0) {
-                    add_udev_device(dev);
+                    add_udev_device(dev, false);
                 } else if (strcmp(action, "remove") == 0) {
                     remove_udev_device(dev);
                 } else if (strcmp(action, "change") == 0) {
-                    remove_udev_device(dev);
-                    add_udev_device(dev);
-                }
+                    add_udev_device(dev, true);
                 }
+            }
 
             udev_device_unref(dev);
         }
     }
+
+    return NULL;
+}
+
+// Applies the results of the udev thread on the main loop
+static void udev_event_func(int fd, unsigned int events, void *arg)
+{
+    struct udev_event event;
+    struct joystick *joystick;
+    uint64_t val;
+
+    (void)events;
+    (void)arg;
+
+    (void)read(fd, &val, sizeof(val));
+
+    for (;;) {
+        if (pthread_mutex_lock(&udev_mutex) != 0)
+            return;
+
+        if (udev_events_head == udev_events_tail) {
+            (void)pthread_mutex_unlock(&udev_mutex);
+            return;
+        }
+
+        memcpy(&event, &udev_events[udev_events_head++ & (UDEV_EVENT_QUEUE_SIZE - 1)], sizeof(event));
+        (void)pthread_cond_signal(&udev_cond);
+
+        (void)pthread_mutex_unlock(&udev_mutex);
+
+        switch (event.action) {
+            case UDEV_EVENT_ADD:
+                if (find_joystick_by_dev(event.joystick.dev)) {
+                    fprintf(stderr, "add_udev_device: joystick %s allready opened\n", event.joystick.devnode);
+                    close(event.joystick.fd);
+                    udev_reject_dev(event.joystick.dev);
+                } else if (! add_probed_joystick(&event.joystick)) {
+                    fprintf(stderr, "add_udev_device: unable to add %s\n", event.joystick.devnode);
+                    udev_reject_dev(event.joystick.dev);
+                }
+                break;
+            case UDEV_EVENT_REMOVE:
+                while ((joystick = find_joystick_by_devnode(event.joystick.devnode)) != NULL) {
+                    fprintf(stderr, "remove_udev_device: removed joystick %s\n", event.joystick.devnode);
+                    close_joystick(joystick);
+                }
+                break;
+            case UDEV_EVENT_CHANGE:
+                if (find_joystick_by_dev(event.joystick.dev)) {
+                    fprintf(stderr, "change_udev_device: keeping joystick %s\n", event.joystick.devnode);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void init_udev_hotplug(void)
+{
+    if (udev_ctx != NULL) {
+        fprintf(stderr, "init_udev_hotplug: udev already initialized.\n");
+        return;
+    }
+
+    udev_ctx = udev_new();
+
+    if (! udev_ctx) {
+        fprintf(stderr, "init_udev_hotplug: unable to initialize udev.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    udev_monitor = udev_monitor_new_from_netlink(udev_ctx, "udev");
+    if (udev_monitor) {
+        udev_monitor_filter_add_match_subsystem_devtype(udev_monitor, "input", NULL);
+        udev_monitor_enable_receiving(udev_monitor);
+    } else {
+        fprintf(stderr, "init_udev_hotplug: unable to initialize udev monitor.\n");
+    }
+
+    udev_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (udev_event_fd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    if (! loop_add_fd(udev_event_fd, EPOLLIN, udev_event_func, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Opening joysticks takes a couple of ioctls each, the first frame should not have to wait for that
+    if (pthread_create(&udev_thread, NULL, udev_thread_func, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    (void)pthread_detach(udev_thread);
 }
 
 static void process_keyboard_input(struct joystick *joystick, char key)
@@ -589,21 +1005,92 @@ static void process_joystick_event(struct joystick *joystick, struct js_event *e
     }
 }
 
-bool read_joystick(struct joystick **joystick_ptr)
+static bool read_js_event(struct joystick *joystick, struct js_event *event)
+{
+    struct js_event_buffer *buffer = &js_event_buffers[joystick - joysticks];
+    ssize_t len;
+
+    if (buffer->pos >= buffer->count) {
+        len = read(joystick->fd, buffer->events, sizeof(buffer->events));
+        if (len < (ssize_t)sizeof(buffer->events[0]))
+            return false;
+        buffer->pos = 0;
+        buffer->count = len / sizeof(buffer->events[0]);
+    }
+
+    *event = buffer->events[buffer->pos++];
+    return true;
+}
+
+static bool read_joystick_event(struct joystick *joystick)
+{
+    struct js_event event = { 0 };
+    int key_state;
+
+    while (frame_reads < MAX_FRAME_READS && read_js_event(joystick, &event)) {
+        frame_reads++;
+
+        key_state = joystick->key_state;
+        process_joystick_event(joystick, &event);
+
+        // Analog sticks report every small movement, only direction changes matter
+        if ((event.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS && joystick->key_state == key_state) {
+            stats.coalesced++;
+            continue;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// Unread events keep the level triggered fds ready, so they stop waking the
+// loop until the next frame gives them a new budget
+static void park_joysticks(bool parked)
 {
     size_t i;
+
+    if (joysticks_parked == parked)
+        return;
+    joysticks_parked = parked;
+
+    for (i = 0; i < num_joysticks; i++) {
+        if (joysticks[i].fd != -1 && joysticks[i].type != INPUT_NETWORK)
+            loop_mod_fd(joysticks[i].fd, parked ? 0 : EPOLLIN);
+    }
+}
+
+void input_begin_frame(void)
+{
+    net_input_expire();
+
+    frame_events = 0;
+    frame_reads = 0;
+    park_joysticks(false);
+}
+
+bool read_joystick(struct joystick **joystick_ptr)
+{
+    size_t i, n;
     struct joystick *joystick = NULL;
     char key;
-    struct js_event event = { 0 };
-
-    udev_monitor_poll();
 
     if (num_joysticks <= 0) {
         *joystick_ptr = NULL;
         return false;
     }
 
-    for (i = 0; i < num_joysticks && ! joystick; i++) {
+    if (frame_events >= MAX_FRAME_EVENTS || frame_reads >= MAX_FRAME_READS) {
+        stats.deferred++;
+        park_joysticks(true);
+        *joystick_ptr = NULL;
+        return false;
+    }
+
+    // Round robin, so a single busy device can not starve the others
+    for (n = 0; n < num_joysticks && ! joystick; n++) {
+        i = (next_joystick + n) % num_joysticks;
         if (joysticks[i].fd == -1)
             continue;
 
@@ -618,9 +1105,13 @@ bool read_joystick(struct joystick **joystick_ptr)
                 }
                 break;
             case INPUT_JOYSTICK:
-                if (read(joysticks[i].fd, &event, sizeof(event)) == sizeof(event)) {
+                if (read_joystick_event(&joysticks[i])) {
+                    joystick = &joysticks[i];
+                }
+                break;
+            case INPUT_NETWORK:
+                if (net_input_read(&joysticks[i])) {
                     joystick = &joysticks[i];
-                    process_joystick_event(joystick, &event);
                 }
                 break;
             default:
@@ -633,55 +1124,47 @@ bool read_joystick(struct joystick **joystick_ptr)
         return false;
     }
 
+    next_joystick = (joystick - joysticks) + 1;
+    frame_events++;
+    stats.events++;
+
+    joystick->key_seq_match = KEY_SEQ_NONE;
     if (joystick->last_key_idx != KEYPAD_NONE && joystick->last_key_val) {
-        memmove(&joystick->key_history[1], &joystick->key_history[0], sizeof(joystick->key_history) - sizeof(joystick->key_history[0]));
-        joystick->key_history[0] = joystick->last_key_idx;
+        joystick->key_seq_state = key_seq_advance(joystick->key_seq_state, joystick->last_key_idx, &joystick->key_seq_match);
     }
 
     *joystick_ptr = joystick;
     return true;
 }
 
-int count_joysticks(void)
+void input_get_stats(struct input_stats *input_stats)
 {
-    size_t i;
-    int cnt = 0;
-
-    for (i = 0; i < num_joysticks; i++) {
-        if (joysticks[i].fd != -1) {
-            cnt++;
-        }
-    }
+    *input_stats = stats;
+    input_stats->dropped = net_input_dropped();
+}
 
-    return cnt;
+int count_joysticks(void)
+{
+    return active_joysticks;
 }
 
-bool joystick_is_key_seq(struct joystick *joystick, const int *seq, size_t seq_length)
+int count_players(void)
 {
-    size_t hi, si;
+    return __builtin_popcountll(player_map);
+}
 
+int joystick_key_seq(struct joystick *joystick)
+{
     if (! joystick)
-        return false;
-
-    if (seq_length > KEY_HISTORY_SIZE)
-        return false;
+        return KEY_SEQ_NONE;
 
-    for (hi = seq_length - 1, si = 0; si < seq_length; hi--, si++) {
-        if (joystick->key_history[hi] != seq[si])
-            return false;
-    }
-
-    return true;
+    return joystick->key_seq_match;
 }
 
 bool has_player(int player)
 {
-    size_t i;
-
-    for (i = 0; i < num_joysticks; i++) {
-        if (joysticks[i].fd != -1 && joysticks[i].player == player)
-            return true;
-    }
+    if (player < 1 || player > PLAYER_MAP_BITS)
+        return false;
 
-    return false;
+    return (player_map >> (player - 1)) & 1;
 }
@@ -435,4 +435,5 @@ const struct game invaders_game = {
     tick,
     render,
     idle,
+    false,
 };
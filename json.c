@@ -0,0 +1,377 @@
+/* streaming JSON reader */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matelight.h"
+
+/*
+ * Push parser: input is fed in arbitrary chunks (e.g. straight from a curl
+ * write callback) and every scalar value is reported with its dotted path,
+ * array elements use their index as path component ("leds.matrix.w",
+ * "segs.0.id"). Nothing is allocated, strings longer than JSON_MAX_TOKEN
+ * and paths longer than JSON_MAX_PATH are truncated.
+ */
+
+#define JSON_ST_VALUE          0   // expecting a value
+#define JSON_ST_VALUE_OR_END   1   // after '['
+#define JSON_ST_KEY_OR_END     2   // after '{'
+#define JSON_ST_KEY_START      3   // after ',' in an object
+#define JSON_ST_KEY            4   // inside a key string
+#define JSON_ST_COLON          5
+#define JSON_ST_STRING         6   // inside a value string
+#define JSON_ST_LITERAL        7   // inside a number, true, false or null
+#define JSON_ST_AFTER_VALUE    8   // expecting ',' or the end of the container
+#define JSON_ST_DONE           9
+#define JSON_ST_ERROR          10
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void token_append(struct json_parser *p, char c)
+{
+    if (p->token_len < sizeof(p->token) - 1)
+        p->token[p->token_len++] = c;
+}
+
+static void token_append_utf8(struct json_parser *p, unsigned int cp)
+{
+    // Surrogate pairs are not worth the state, they end up as '?'
+    if (cp >= 0xd800 && cp <= 0xdfff) {
+        token_append(p, '?');
+    } else if (cp < 0x80) {
+        token_append(p, cp);
+    } else if (cp < 0x800) {
+        token_append(p, 0xc0 | (cp >> 6));
+        token_append(p, 0x80 | (cp & 0x3f));
+    } else {
+        token_append(p, 0xe0 | (cp >> 12));
+        token_append(p, 0x80 | ((cp >> 6) & 0x3f));
+        token_append(p, 0x80 | (cp & 0x3f));
+    }
+}
+
+static void path_set(struct json_parser *p, const char *component, size_t len)
+{
+    size_t base = p->path_base[p->depth];
+    size_t sep = base > 0 ? 1 : 0;
+
+    if (base + sep >= sizeof(p->path) - 1) {
+        sep = 0;
+        len = 0;
+    } else if (base + sep + len >= sizeof(p->path)) {
+        len = sizeof(p->path) - 1 - base - sep;
+    }
+
+    if (sep)
+        p->path[base] = '.';
+    memcpy(p->path + base + sep, component, len);
+    p->path_len = base + sep + len;
+    p->path[p->path_len] = '\0';
+}
+
+static void path_set_index(struct json_parser *p)
+{
+    char index[16];
+    int len;
+
+    len = snprintf(index, sizeof(index), "%u", p->index[p->depth]);
+    path_set(p, index, (size_t)len);
+}
+
+static bool container_open(struct json_parser *p, char c)
+{
+    if (p->depth >= JSON_MAX_DEPTH)
+        return false;
+
+    p->depth++;
+    p->stack[p->depth] = c;
+    p->index[p->depth] = 0;
+    p->path_base[p->depth] = p->path_len;
+
+    if (c == '[') {
+        path_set_index(p);
+        p->state = JSON_ST_VALUE_OR_END;
+    } else {
+        p->state = JSON_ST_KEY_OR_END;
+    }
+
+    return true;
+}
+
+static bool container_close(struct json_parser *p, char c)
+{
+    if (p->depth == 0 || p->stack[p->depth] != (c == ']' ? '[' : '{'))
+        return false;
+
+    p->depth--;
+    p->path_len = p->path_base[p->depth + 1];
+    p->path[p->path_len] = '\0';
+    p->state = p->depth == 0 ? JSON_ST_DONE : JSON_ST_AFTER_VALUE;
+
+    return true;
+}
+
+static void value_done(struct json_parser *p, int type)
+{
+    p->token[p->token_len] = '\0';
+    if (p->func)
+        p->func(p->path, type, p->token, p->token_len, p->arg);
+
+    p->state = p->depth == 0 ? JSON_ST_DONE : JSON_ST_AFTER_VALUE;
+}
+
+static const char *skip_digits(const char *s)
+{
+    while (*s >= '0' && *s <= '9')
+        s++;
+
+    return s;
+}
+
+// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?, strtod would also take nan, inf and hex
+static bool is_number(const char *s)
+{
+    const char *end;
+
+    if (*s == '-')
+        s++;
+    if (*s == '0') {
+        s++;
+    } else {
+        end = skip_digits(s);
+        if (end == s)
+            return false;
+        s = end;
+    }
+
+    if (*s == '.') {
+        end = skip_digits(++s);
+        if (end == s)
+            return false;
+        s = end;
+    }
+
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '+' || *s == '-')
+            s++;
+        end = skip_digits(s);
+        if (end == s)
+            return false;
+        s = end;
+    }
+
+    return *s == '\0';
+}
+
+static bool literal_done(struct json_parser *p)
+{
+    p->token[p->token_len] = '\0';
+    if (strcmp(p->token, "true") == 0) {
+        value_done(p, JSON_TYPE_TRUE);
+    } else if (strcmp(p->token, "false") == 0) {
+        value_done(p, JSON_TYPE_FALSE);
+    } else if (strcmp(p->token, "null") == 0) {
+        value_done(p, JSON_TYPE_NULL);
+    } else {
+        if (! is_number(p->token))
+            return false;
+        value_done(p, JSON_TYPE_NUMBER);
+    }
+
+    return true;
+}
+
+// Handles one character inside a string, returns true when the closing quote was seen
+static bool string_char(struct json_parser *p, char c, bool *error)
+{
+    int digit;
+
+    if (p->unicode_left > 0) {
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            *error = true;
+            return false;
+        }
+        p->unicode = (p->unicode << 4) | digit;
+        if (--p->unicode_left == 0)
+            token_append_utf8(p, p->unicode);
+        return false;
+    }
+
+    if (p->escape) {
+        p->escape = false;
+        switch (c) {
+            case '"':  token_append(p, '"'); break;
+            case '\\': token_append(p, '\\'); break;
+            case '/':  token_append(p, '/'); break;
+            case 'b':  token_append(p, '\b'); break;
+            case 'f':  token_append(p, '\f'); break;
+            case 'n':  token_append(p, '\n'); break;
+            case 'r':  token_append(p, '\r'); break;
+            case 't':  token_append(p, '\t'); break;
+            case 'u':
+                p->unicode = 0;
+                p->unicode_left = 4;
+                break;
+            default:
+                *error = true;
+                break;
+        }
+        return false;
+    }
+
+    if (c == '\\') {
+        p->escape = true;
+        return false;
+    }
+
+    if (c == '"')
+        return true;
+
+    if ((unsigned char)c < 0x20) {
+        *error = true;
+        return false;
+    }
+
+    token_append(p, c);
+    return false;
+}
+
+void json_init(struct json_parser *p, json_value_func func, void *arg)
+{
+    memset(p, '\0', sizeof(*p));
+    p->state = JSON_ST_VALUE;
+    p->func = func;
+    p->arg = arg;
+}
+
+static bool json_char(struct json_parser *p, char c)
+{
+    bool error = false;
+
+    switch (p->state) {
+        case JSON_ST_VALUE:
+        case JSON_ST_VALUE_OR_END:
+            if (is_space(c))
+                return true;
+            if (c == ']' && p->state == JSON_ST_VALUE_OR_END)
+                return container_close(p, c);
+            p->token_len = 0;
+            if (c == '{' || c == '[')
+                return container_open(p, c);
+            if (c == '"') {
+                p->state = JSON_ST_STRING;
+                return true;
+            }
+            if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n') {
+                token_append(p, c);
+                p->state = JSON_ST_LITERAL;
+                return true;
+            }
+            return false;
+
+        case JSON_ST_KEY_OR_END:
+        case JSON_ST_KEY_START:
+            if (is_space(c))
+                return true;
+            if (c == '}' && p->state == JSON_ST_KEY_OR_END)
+                return container_close(p, c);
+            if (c != '"')
+                return false;
+            p->token_len = 0;
+            p->state = JSON_ST_KEY;
+            return true;
+
+        case JSON_ST_KEY:
+            if (string_char(p, c, &error)) {
+                path_set(p, p->token, p->token_len);
+                p->state = JSON_ST_COLON;
+            }
+            return ! error;
+
+        case JSON_ST_COLON:
+            if (is_space(c))
+                return true;
+            if (c != ':')
+                return false;
+            p->state = JSON_ST_VALUE;
+            return true;
+
+        case JSON_ST_STRING:
+            if (string_char(p, c, &error))
+                value_done(p, JSON_TYPE_STRING);
+            return ! error;
+
+        case JSON_ST_LITERAL:
+            if (! is_space(c) && c != ',' && c != '}' && c != ']') {
+                if (p->token_len >= sizeof(p->token) - 1)
+                    return false;
+                token_append(p, c);
+                return true;
+            }
+            if (! literal_done(p))
+                return false;
+            return json_char(p, c);
+
+        case JSON_ST_AFTER_VALUE:
+            if (is_space(c))
+                return true;
+            if (c == ',') {
+                if (p->stack[p->depth] == '[') {
+                    p->index[p->depth]++;
+                    path_set_index(p);
+                    p->state = JSON_ST_VALUE;
+                } else {
+                    p->state = JSON_ST_KEY_START;
+                }
+                return true;
+            }
+            if (c == '}' || c == ']')
+                return container_close(p, c);
+            return false;
+
+        case JSON_ST_DONE:
+            return is_space(c);
+
+        default:
+            return false;
+    }
+}
+
+bool json_feed(struct json_parser *p, const char *data, size_t len)
+{
+    size_t i;
+
+    if (p->state == JSON_ST_ERROR)
+        return false;
+
+    for (i = 0; i < len; i++) {
+        if (! json_char(p, data[i])) {
+            p->state = JSON_ST_ERROR;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool json_finish(struct json_parser *p)
+{
+    // A top level number has no delimiter behind it
+    if (p->state == JSON_ST_LITERAL && p->depth == 0 && ! literal_done(p))
+        p->state = JSON_ST_ERROR;
+
+    return p->state == JSON_ST_DONE;
+}
@@ -0,0 +1,149 @@
+/* key sequence matcher (Aho-Corasick over keypad keys) */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "matelight.h"
+
+// One symbol per keypad key: KEYPAD_LEFT (1 << 0) .. KEYPAD_A (1 << 7)
+#define KEY_SEQ_SYMBOLS     8
+#define KEY_SEQ_MAX_STATES  256
+#define KEY_SEQ_MAX_SEQS    16
+
+#define KEY_SEQ_ROOT        0
+
+struct key_seq_node {
+    unsigned short child[KEY_SEQ_SYMBOLS];  // trie edges, KEY_SEQ_ROOT = no edge
+    unsigned short next[KEY_SEQ_SYMBOLS];   // compiled transitions
+    unsigned short fail;
+    int seq;                                // sequence ending exactly here
+    int match;                              // longest sequence ending here
+};
+
+static struct key_seq_node nodes[KEY_SEQ_MAX_STATES] = { 0 };
+static size_t num_nodes = 1;
+static int num_seqs = 0;
+
+static int key_seq_symbol(int key_idx)
+{
+    if (key_idx <= KEYPAD_NONE || key_idx > KEYPAD_A || (key_idx & (key_idx - 1)))
+        return -1;
+
+    return __builtin_ctz(key_idx);
+}
+
+static void key_seq_compile(void)
+{
+    unsigned short queue[KEY_SEQ_MAX_STATES];
+    size_t head = 0, tail = 0;
+    unsigned short state, child, fail;
+    int sym;
+
+    // Breadth first over the trie, depth 1 nodes fail to the root
+    for (sym = 0; sym < KEY_SEQ_SYMBOLS; sym++) {
+        child = nodes[KEY_SEQ_ROOT].child[sym];
+        nodes[KEY_SEQ_ROOT].next[sym] = child;
+        if (child != KEY_SEQ_ROOT) {
+            nodes[child].fail = KEY_SEQ_ROOT;
+            queue[tail++] = child;
+        }
+    }
+
+    while (head < tail) {
+        state = queue[head++];
+
+        if (nodes[state].seq != KEY_SEQ_NONE)
+            nodes[state].match = nodes[state].seq;
+        else
+            nodes[state].match = nodes[nodes[state].fail].match;
+
+        for (sym = 0; sym < KEY_SEQ_SYMBOLS; sym++) {
+            child = nodes[state].child[sym];
+            fail = nodes[nodes[state].fail].next[sym];
+            if (child != KEY_SEQ_ROOT) {
+                nodes[child].fail = fail;
+                nodes[state].next[sym] = child;
+                queue[tail++] = child;
+            } else {
+                nodes[state].next[sym] = fail;
+            }
+        }
+    }
+}
+
+int key_seq_register(const int *seq, size_t seq_length)
+{
+    size_t i, new_nodes = 0;
+    unsigned short state = KEY_SEQ_ROOT;
+    int sym;
+
+    if (! seq || seq_length == 0 || num_seqs >= KEY_SEQ_MAX_SEQS)
+        return KEY_SEQ_NONE;
+
+    for (i = 0; i < seq_length; i++) {
+        if (key_seq_symbol(seq[i]) < 0)
+            return KEY_SEQ_NONE;
+    }
+
+    if (num_nodes == 1) {
+        memset(&nodes[KEY_SEQ_ROOT], '\0', sizeof(nodes[KEY_SEQ_ROOT]));
+        nodes[KEY_SEQ_ROOT].seq = KEY_SEQ_NONE;
+        nodes[KEY_SEQ_ROOT].match = KEY_SEQ_NONE;
+    }
+
+    // Count missing nodes first so a failed registration leaves the trie untouched
+    for (i = 0; i < seq_length; i++) {
+        sym = key_seq_symbol(seq[i]);
+        if (nodes[state].child[sym] == KEY_SEQ_ROOT) {
+            new_nodes = seq_length - i;
+            break;
+        }
+        state = nodes[state].child[sym];
+    }
+    if (num_nodes + new_nodes > KEY_SEQ_MAX_STATES) {
+        fprintf(stderr, "key_seq_register: too many key sequence states\n");
+        return KEY_SEQ_NONE;
+    }
+
+    state = KEY_SEQ_ROOT;
+    for (i = 0; i < seq_length; i++) {
+        sym = key_seq_symbol(seq[i]);
+        if (nodes[state].child[sym] == KEY_SEQ_ROOT) {
+            memset(&nodes[num_nodes], '\0', sizeof(nodes[num_nodes]));
+            nodes[num_nodes].seq = KEY_SEQ_NONE;
+            nodes[num_nodes].match = KEY_SEQ_NONE;
+            nodes[state].child[sym] = num_nodes++;
+        }
+        state = nodes[state].child[sym];
+    }
+
+    if (nodes[state].seq != KEY_SEQ_NONE) {
+        // Same sequence registered twice
+        return nodes[state].seq;
+    }
+    nodes[state].seq = num_seqs;
+
+    key_seq_compile();
+
+    return num_seqs++;
+}
+
+int key_seq_advance(int state, int key_idx, int *match)
+{
+    int sym = key_seq_symbol(key_idx);
+
+    if (state < 0 || (size_t)state >= num_nodes)
+        state = KEY_SEQ_ROOT;
+
+    if (sym < 0) {
+        *match = KEY_SEQ_NONE;
+        return KEY_SEQ_ROOT;
+    }
+
+    state = nodes[state].next[sym];
+    *match = nodes[state].match;
+
+    return state;
+}
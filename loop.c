@@ -0,0 +1,244 @@
+/* main loop reactor */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "matelight.h"
+
+#define LOOP_MAX_FDS    128
+#define LOOP_MAX_EVENTS 16
+
+struct loop_handler {
+    bool used;
+    bool active;
+    bool timer;
+    int fd;
+    loop_fd_func func;
+    void *arg;
+};
+
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
+static struct loop_handler handlers[LOOP_MAX_FDS] = { 0 };
+static bool release_pending = false;
+
+static struct loop_handler *find_handler(int fd)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(handlers); i++) {
+        if (handlers[i].used && handlers[i].active && handlers[i].fd == fd)
+            return &handlers[i];
+    }
+
+    return NULL;
+}
+
+static void wakeup_func(int fd, unsigned int events, void *arg)
+{
+    uint64_t val;
+
+    (void)events;
+    (void)arg;
+
+    (void)read(fd, &val, sizeof(val));
+}
+
+void loop_init(void)
+{
+    if (epoll_fd != -1)
+        return;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    (void)loop_add_fd(wakeup_fd, EPOLLIN, wakeup_func, NULL);
+}
+
+bool loop_add_fd(int fd, unsigned int events, loop_fd_func func, void *arg)
+{
+    size_t i;
+    struct epoll_event ev = { 0 };
+
+    if (epoll_fd == -1 || fd < 0)
+        return false;
+
+    for (i = 0; i < ARRAY_LENGTH(handlers); i++) {
+        if (! handlers[i].used)
+            break;
+    }
+    if (i == ARRAY_LENGTH(handlers)) {
+        fprintf(stderr, "loop_add_fd: too many file descriptors\n");
+        return false;
+    }
+
+    ev.events = events;
+    ev.data.ptr = &handlers[i];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        return false;
+    }
+
+    handlers[i].used = true;
+    handlers[i].active = true;
+    handlers[i].timer = false;
+    handlers[i].fd = fd;
+    handlers[i].func = func;
+    handlers[i].arg = arg;
+
+    return true;
+}
+
+void loop_mod_fd(int fd, unsigned int events)
+{
+    struct loop_handler *handler;
+    struct epoll_event ev = { 0 };
+
+    handler = find_handler(fd);
+    if (! handler)
+        return;
+
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+    }
+}
+
+void loop_del_fd(int fd)
+{
+    struct loop_handler *handler;
+
+    handler = find_handler(fd);
+    if (! handler)
+        return;
+
+    (void)epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    // Events for this handler may still be pending in the current loop_wait() round,
+    // the slot is only handed out again once that round is over
+    handler->active = false;
+    handler->fd = -1;
+    release_pending = true;
+}
+
+// One shot timers, func is called once the timer expired and has been read
+int loop_add_timer(loop_fd_func func, void *arg)
+{
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    if (! loop_add_fd(fd, EPOLLIN, func, arg)) {
+        close(fd);
+        return -1;
+    }
+
+    find_handler(fd)->timer = true;
+
+    return fd;
+}
+
+// Fires after timeout_ms, 0 as soon as possible, -1 disarms
+void loop_set_timer(int fd, long timeout_ms)
+{
+    struct itimerspec its = { { 0 }, { 0 } };
+
+    if (fd == -1)
+        return;
+
+    if (timeout_ms == 0) {
+        its.it_value.tv_nsec = 1;
+    } else if (timeout_ms > 0) {
+        its.it_value.tv_sec = timeout_ms / 1000;
+        its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+    }
+
+    (void)timerfd_settime(fd, 0, &its, NULL);
+}
+
+void loop_del_timer(int fd)
+{
+    if (fd == -1)
+        return;
+
+    loop_del_fd(fd);
+    close(fd);
+}
+
+void loop_wait(int timeout_ms)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    struct loop_handler *handler;
+    uint64_t expirations;
+    int n, i;
+    size_t hi;
+
+    if (epoll_fd == -1)
+        return;
+
+    if (timeout_ms < 0)
+        timeout_ms = 0;
+
+    n = epoll_wait(epoll_fd, events, ARRAY_LENGTH(events), timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        handler = events[i].data.ptr;
+        if (! handler->active)
+            continue;
+
+        // Rearmed since it expired
+        if (handler->timer && read(handler->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            continue;
+
+        if (handler->func) {
+            handler->func(handler->fd, events[i].events, handler->arg);
+        } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+            // Nobody to handle a hangup, stop it from waking us up again and again
+            loop_del_fd(handler->fd);
+        }
+    }
+
+    if (release_pending) {
+        for (hi = 0; hi < ARRAY_LENGTH(handlers); hi++) {
+            if (handlers[hi].used && ! handlers[hi].active)
+                handlers[hi].used = false;
+        }
+        release_pending = false;
+    }
+}
+
+void loop_wakeup(void)
+{
+    uint64_t val = 1;
+
+    if (wakeup_fd == -1)
+        return;
+
+    (void)write(wakeup_fd, &val, sizeof(val));
+}
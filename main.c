@@ -5,15 +5,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <locale.h>
 #include <getopt.h>
-#include <pthread.h>
+#include <errno.h>
 
 #include "matelight.h"
 
@@ -22,7 +24,11 @@ int grid_height = DEFAULT_GRID_HEIGHT;
 bool grid_widescreen = true;
 static char *address = NULL;
 static int wled_port = 21324;
+static bool wled_port_auto = true;
+static bool grid_auto = true;
 static char *mdns_description = NULL;
+static char *cache_file = NULL;
+static char *score_file = NULL;
 static char *joypad_dev = NULL;
 static bool joypad_udev = false;
 static bool keyboard = false;
@@ -30,28 +36,53 @@ static int start_game = -1;
 static bool start_on_startup = false;
 static bool debug = false;
 static bool mqtt = false;
+static int net_input_port = 0;
+static int frame_ingest_port = 0;
+static const char *framebuffer_path = NULL;
+static int brightness = 0;
+static int night_brightness = 0;
+static int night_from = 23;
+static int night_to = 7;
+static int idle_off_secs = 0;
+static bool wled_idle_off = false;
+static bool wled_streaming = false;
+static double last_activity_val = 0.0;
+static time_t last_state_check = 0;
 
 static struct sockaddr_storage udp_sockaddr = { 0 };
 static char wled_ip_new[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)] = { 0 };
+static struct wled_info wled_info_new = { 0 };
+static bool wled_info_pending = false;
 const char *wled_ds = NULL;
 static int udp_fd = -1;
+static int udp_fd_family = AF_UNSPEC;
+static char wled_address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)] = { 0 };
+static double last_udp_error_val = -1.0;
 
 static int joystick_cnt = 0;
 
 static double start_time_val = 0.0;
 double time_val = 0.0;
 static double last_tick_val = 0.0;
+static double next_frame_val = 0.0;
 int ticks = 0;
 
 static bool display = false;
-//static char udp_data[65536];
-static char udp_data[2 + (MAX_GRID_SIZE * 3)] = { 0 };
+static char frame[MAX_GRID_SIZE * 3] = { 0 };
+static char last_frame[MAX_GRID_SIZE * 3] = { 0 };
+static double last_frame_val = -1.0;
 
-#define UDP_DATA_SIZE (2 + (grid_width * grid_height * 3))
+#define FRAME_INTERVAL 0.1
+// Unchanged frames are repeated this often, well within DISPLAY_TIMEOUT
+#define FRAME_KEEPALIVE 1.0
 
 static const struct game *games[] = {
     &debug_game,
     &announce_game,
+    &animation_game,
+    &ingest_game,
+    &framebuffer_game,
+    &ambient_game,
     &snake_game,
     &tetris_game,
     &flappy_game,
@@ -61,13 +92,6 @@ static const struct game *games[] = {
 };
 static int cur_game = 0;
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static bool async_announce = false;
-static char *async_announce_text = NULL;
-static unsigned int async_announce_color = COLOR_WHITE;
-static unsigned int async_announce_bgcolor = COLOR_BLACK;
-static double async_announce_speed = 5.0;
-
 static const int konami_code[] = {
     KEYPAD_UP,
     KEYPAD_UP,
@@ -81,6 +105,10 @@ static const int konami_code[] = {
     KEYPAD_A,
     KEYPAD_START
 };
+static int konami_seq = KEY_SEQ_NONE;
+
+// Remote key events look like a joypad of the player they are sent for
+static struct joystick remote_pads[REMOTE_MAX_PLAYERS];
 
 static const struct game *get_game(void)
 {
@@ -88,6 +116,8 @@ static const struct game *get_game(void)
 
     for (i = 0; i < ARRAY_LENGTH(games); i++) {
         if (! games[i]->playable && ! games[i]->idle_func()) {
+            if (games[i]->yields_to_players && ! games[cur_game]->idle_func())
+                continue;
             return games[i];
         }
     }
@@ -95,47 +125,143 @@ static const struct game *get_game(void)
     return games[cur_game];
 }
 
-static void handle_input(void)
+// Streams shown instead of an idle game leave the joypads to it, so players can start
+static const struct game *get_input_game(void)
 {
-    int new_joystick_cnt = 0;
-    char text[100] = { 0 };
-    struct joystick *joystick = NULL;
+    if (get_game()->yields_to_players)
+        return games[cur_game];
 
-    while (read_joystick(&joystick)) {
-        if (joystick->last_key_idx == KEYPAD_SELECT && joystick->last_key_val && get_game()->playable && (! get_game()->non_interruptable)) {
-            if (get_game()->deactivate_func) {
-                get_game()->deactivate_func();
-            }
-            if (joystick->key_state & KEYPAD_START) {
-                fprintf(stderr, "starting debug game\n");
-                debug_game.activate_func(true);
-            } else {
-                do {
-                    cur_game++;
-                    cur_game %= ARRAY_LENGTH(games);
-                } while (! get_game()->playable);
-                if (get_game()->activate_func) {
-                    fprintf(stderr, "starting game: %s\n", get_game()->name);
-                    get_game()->activate_func(true);
-                }
+    return get_game();
+}
+
+static int find_game(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(games); i++) {
+        if (strcmp(games[i]->name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static bool can_switch_game(void)
+{
+    return get_input_game()->playable && ! get_input_game()->non_interruptable;
+}
+
+static void switch_game(int game, bool start)
+{
+    if (get_input_game()->deactivate_func) {
+        get_input_game()->deactivate_func();
+    }
+    cur_game = game;
+    if (get_input_game()->activate_func) {
+        fprintf(stderr, "starting game: %s\n", get_input_game()->name);
+        get_input_game()->activate_func(start);
+    }
+}
+
+static void handle_key(struct joystick *joystick)
+{
+    int game;
+
+    if (joystick->last_key_idx == KEYPAD_SELECT && joystick->last_key_val && can_switch_game()) {
+        if (joystick->key_state & KEYPAD_START) {
+            if (get_input_game()->deactivate_func) {
+                get_input_game()->deactivate_func();
             }
+            fprintf(stderr, "starting debug game\n");
+            debug_game.activate_func(true);
+        } else {
+            game = cur_game;
+            do {
+                game++;
+                game %= ARRAY_LENGTH(games);
+            } while (! games[game]->playable);
+            switch_game(game, true);
         }
+    }
 
-        if (joystick_is_key_seq(joystick, konami_code, ARRAY_LENGTH(konami_code))) {
-            fprintf(stderr, "konami code activated\n");
-            if (get_game()->deactivate_func) {
-                get_game()->deactivate_func();
-            }
-            if (get_game()->activate_func) {
-                get_game()->activate_func(false);
-            }
-            do_announce("HACK THE PLANET", COLOR_BLACK, COLOR_YELLOW, 10.0);
+    if (konami_seq != KEY_SEQ_NONE && joystick_key_seq(joystick) == konami_seq) {
+        fprintf(stderr, "konami code activated\n");
+        if (get_input_game()->deactivate_func) {
+            get_input_game()->deactivate_func();
+        }
+        if (get_input_game()->activate_func) {
+            get_input_game()->activate_func(false);
         }
+        do_announce("HACK THE PLANET", COLOR_BLACK, COLOR_YELLOW, 10.0);
+    }
 
-        if (get_game()->input_func) {
-            get_game()->input_func(joystick->player, joystick->last_key_idx, joystick->last_key_val, joystick->key_state);
+    if (get_input_game()->input_func) {
+        get_input_game()->input_func(joystick->player, joystick->last_key_idx, joystick->last_key_val, joystick->key_state);
+    }
+}
+
+// Commands from MQTT, run like joypad input
+static void handle_remote(void)
+{
+    struct remote_command cmd;
+    struct joystick *pad;
+    int game;
+
+    while (remote_pop(&cmd)) {
+        last_activity_val = time_val;
+
+        switch (cmd.type) {
+            case REMOTE_GAME:
+            case REMOTE_DEMO:
+                game = find_game(cmd.game);
+                if (game == -1 || ! games[game]->playable) {
+                    fprintf(stderr, "remote: game \"%s\" not found\n", cmd.game);
+                    break;
+                }
+                if (! can_switch_game()) {
+                    fprintf(stderr, "remote: %s can not be interrupted\n", get_input_game()->name);
+                    break;
+                }
+                switch_game(game, cmd.type == REMOTE_GAME);
+                break;
+
+            case REMOTE_STOP:
+                if (can_switch_game() && get_input_game()->deactivate_func) {
+                    fprintf(stderr, "stopping game: %s\n", get_input_game()->name);
+                    get_input_game()->deactivate_func();
+                }
+                break;
+
+            case REMOTE_KEY:
+                pad = &remote_pads[cmd.player - 1];
+                pad->player = cmd.player;
+                pad->last_key_idx = cmd.key_idx;
+                pad->last_key_val = cmd.key_val;
+                if (cmd.key_val) {
+                    pad->key_state |= cmd.key_idx;
+                } else {
+                    pad->key_state &= ~cmd.key_idx;
+                }
+                pad->key_seq_match = KEY_SEQ_NONE;
+                handle_key(pad);
+                break;
+
+            default:
+                break;
         }
     }
+}
+
+static void handle_input(void)
+{
+    int new_joystick_cnt = 0;
+    char text[100] = { 0 };
+    struct joystick *joystick = NULL;
+
+    while (read_joystick(&joystick)) {
+        last_activity_val = time_val;
+        handle_key(joystick);
+    }
 
     new_joystick_cnt = count_joysticks();
     if (joystick_cnt != new_joystick_cnt) {
@@ -162,17 +288,7 @@ static double get_time_val(void)
 
 void do_announce(const char *text, unsigned int color, unsigned int bgcolor, double speed)
 {
-    if (get_game()->idle_func()) {
-        if (announce_game.idle_func()) {
-            fprintf(stderr, "announcing text: %s\n", text);
-            set_announce_text(text, color, bgcolor, speed);
-            announce_game.activate_func(true);
-        } else {
-            fprintf(stderr, "not announcing text (announce already in progress): %s\n", text);
-        }
-    } else {
-        fprintf(stderr, "not announcing text (game is active): %s\n", text);
-    }
+    (void)announce_push(text, color, bgcolor, speed, ANNOUNCE_FONT_NORMAL, ANNOUNCE_PRIO_NORMAL, 1, ANNOUNCE_TTL);
 }
 
 void do_announce_my_ip(void)
@@ -197,82 +313,215 @@ void do_announce_my_ip(void)
     do_announce(text, COLOR_BLUE, COLOR_BLACK, 10.0);
 }
 
-void do_announce_async(char *text, unsigned int color, unsigned int bgcolor, double speed)
+// Announcements wait until nothing else is on and a game is not played
+static void handle_announce_queue(void)
 {
-    if (pthread_mutex_lock(&mutex) != 0)
+    if (! get_game()->idle_func() && ! get_game()->yields_to_players)
         return;
 
-    if (async_announce) {
-        (void)pthread_mutex_unlock(&mutex);
+    if (! announce_game.idle_func())
         return;
+
+    (void)announce_show_next();
+}
+
+// Called from mdns callbacks, the switch is made between two frames
+void update_wled_ip(const char *address, const struct wled_info *info)
+{
+    strncpy(wled_ip_new, address, sizeof(wled_ip_new));
+    wled_ip_new[sizeof(wled_ip_new) - 1] = '\0';
+    if (info) {
+        wled_info_new = *info;
+        wled_info_pending = true;
+    }
+
+    loop_wakeup();
+}
+
+static void connect_udp_socket(void)
+{
+    socklen_t len = udp_sockaddr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    int fd;
+
+    if (udp_sockaddr.ss_family == AF_UNSPEC)
+        return;
+
+    if (udp_fd == -1 || udp_fd_family != udp_sockaddr.ss_family) {
+        fd = socket(udp_sockaddr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            perror("socket");
+            return;
+        }
+        if (udp_fd != -1)
+            close(udp_fd);
+        udp_fd = fd;
+        udp_fd_family = udp_sockaddr.ss_family;
     }
 
-    async_announce = true;
-    async_announce_text = text;
-    async_announce_color = color;
-    async_announce_bgcolor = bgcolor;
-    async_announce_speed = speed;
+    // Connected, so ICMP errors from the controller show up as send() errors
+    if (connect(udp_fd, (struct sockaddr *)&udp_sockaddr, len) != 0) {
+        perror("connect");
+    }
+}
+
+static void udp_send_error(void)
+{
+    if (errno != ECONNREFUSED && errno != EHOSTUNREACH && errno != ENETUNREACH && errno != EHOSTDOWN)
+        return;
+
+    // One report per second is plenty to trigger a failover
+    if (last_udp_error_val >= 0.0 && time_val - last_udp_error_val < 1.0)
+        return;
+    last_udp_error_val = time_val;
 
-    (void)pthread_mutex_unlock(&mutex);
+    fprintf(stderr, "wled controller %s: %s\n", wled_address, strerror(errno));
+    mdns_report_failure(wled_address);
 }
 
-static void handle_announce_async(void)
+static void send_udp_data(void)
 {
-    if (pthread_mutex_lock(&mutex) != 0)
+    unsigned char header[4];
+    struct iovec iov[2];
+    struct msghdr msg = { 0 };
+    int leds = grid_width * grid_height;
+    int start, count;
+    size_t bytes = 0;
+    ssize_t len;
+
+    if (udp_fd == -1 || udp_sockaddr.ss_family == AF_UNSPEC)
         return;
 
-    if (! async_announce) {
-        (void)pthread_mutex_unlock(&mutex);
+    // Header and pixels go out without copying the frame
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ARRAY_LENGTH(iov);
+    iov[0].iov_base = header;
+
+    if (leds <= WLED_DRGB_MAX_LEDS) {
+        header[0] = WLED_DRGB;
+        header[1] = DISPLAY_TIMEOUT;
+        iov[0].iov_len = 2;
+        iov[1].iov_base = frame;
+        iov[1].iov_len = leds * 3;
+        len = sendmsg(udp_fd, &msg, 0);
+        if (len == -1) {
+            udp_send_error();
+            return;
+        }
+        telemetry_frame_sent(len);
         return;
     }
 
-    do_announce(async_announce_text, async_announce_color, async_announce_bgcolor, async_announce_speed);
+    // Too many LEDs for one datagram, DNRGB packets carry their start index
+    for (start = 0; start < leds; start += WLED_DNRGB_MAX_LEDS) {
+        count = MIN(leds - start, WLED_DNRGB_MAX_LEDS);
+        header[0] = WLED_DNRGB;
+        header[1] = DISPLAY_TIMEOUT;
+        header[2] = (start >> 8) & 0xff;
+        header[3] = start & 0xff;
+        iov[0].iov_len = 4;
+        iov[1].iov_base = frame + (start * 3);
+        iov[1].iov_len = count * 3;
+        len = sendmsg(udp_fd, &msg, 0);
+        if (len == -1) {
+            udp_send_error();
+            return;
+        }
+        bytes += len;
+    }
+    telemetry_frame_sent(bytes);
+}
 
-    async_announce = false;
-    if (async_announce_text)
-        free(async_announce_text);
-    async_announce_text = NULL;
-    async_announce_color = COLOR_WHITE;
-    async_announce_bgcolor = COLOR_BLACK;
-    async_announce_speed = 5.0;
+// Static scenes only go out as keepalive
+static bool frame_changed(void)
+{
+    size_t size = grid_width * grid_height * 3;
 
-    (void)pthread_mutex_unlock(&mutex);
+    if (last_frame_val >= 0.0 && time_val - last_frame_val < FRAME_KEEPALIVE && memcmp(frame, last_frame, size) == 0)
+        return false;
+
+    memcpy(last_frame, frame, size);
+    last_frame_val = time_val;
+
+    return true;
 }
 
-void update_wled_ip(const char *address)
+static void set_grid(int width, int height, bool reinit)
 {
-    if (pthread_mutex_lock(&mutex) != 0)
+    size_t i;
+
+    if (width == grid_width && height == grid_height)
         return;
 
-    strncpy(wled_ip_new, address, sizeof(wled_ip_new));
-    wled_ip_new[sizeof(wled_ip_new) - 1] = '\0';
+    if (reinit && get_game()->deactivate_func) {
+        get_game()->deactivate_func();
+    }
 
-    (void)pthread_mutex_unlock(&mutex);
+    grid_width = width;
+    grid_height = height;
+    grid_widescreen = (grid_width > grid_height || (grid_width >= 16 && grid_height >= 10));
+    fprintf(stderr, "grid resolution: %d x %d, grid type: %s, protocol: %s\n", grid_width, grid_height, grid_widescreen ? "widescreen" : "highscreen",
+            (grid_width * grid_height) <= WLED_DRGB_MAX_LEDS ? "DRGB" : "DNRGB");
+
+    if (! reinit)
+        return;
+
+    // Games size their state from the grid when initialized and activated
+    for (i = 0; i < ARRAY_LENGTH(games); i++) {
+        if (games[i]->init_func) {
+            games[i]->init_func();
+        }
+    }
+    if (get_game()->activate_func) {
+        get_game()->activate_func(false);
+    }
 }
 
-static void handle_wled_ip_async(void)
+static void apply_wled_info(const struct wled_info *info, bool reinit)
 {
-    int af = AF_UNSPEC;
-    struct in_addr addr;
-    struct in6_addr addr6;
-    bool update = false;
+    fprintf(stderr, "wled controller: '%s', version: %s, leds: %d, matrix: %d x %d, udp port: %d\n",
+            info->name, info->version, info->leds, info->matrix_width, info->matrix_height, info->udp_port);
+
+    if (wled_port_auto && info->udp_port > 0 && info->udp_port < 65536 && info->udp_port != wled_port) {
+        fprintf(stderr, "using wled udp port: %d\n", info->udp_port);
+        wled_port = info->udp_port;
+        if (udp_sockaddr.ss_family == AF_INET) {
+            ((struct sockaddr_in *)&udp_sockaddr)->sin_port = htons(wled_port);
+        } else if (udp_sockaddr.ss_family == AF_INET6) {
+            ((struct sockaddr_in6 *)&udp_sockaddr)->sin6_port = htons(wled_port);
+        }
+        connect_udp_socket();
+    }
+
+    if (! grid_auto || info->matrix_width == 0 || info->matrix_height == 0)
+        return;
 
-    if (pthread_mutex_lock(&mutex) != 0)
+    if (info->matrix_width < MIN_GRID_WIDTH || info->matrix_width > MAX_GRID_WIDTH ||
+        info->matrix_height < MIN_GRID_HEIGHT || info->matrix_height > MAX_GRID_HEIGHT) {
+        fprintf(stderr, "wled matrix %d x %d is not supported, keeping %d x %d\n", info->matrix_width, info->matrix_height, grid_width, grid_height);
         return;
+    }
 
-    if (! *wled_ip_new) {
-        (void)pthread_mutex_unlock(&mutex);
+    if (info->leds > 0 && info->leds < info->matrix_width * info->matrix_height) {
+        fprintf(stderr, "wled matrix %d x %d has only %d leds, keeping %d x %d\n", info->matrix_width, info->matrix_height, info->leds, grid_width, grid_height);
         return;
     }
 
-    if (inet_pton(AF_INET, wled_ip_new, &addr)) {
+    set_grid(info->matrix_width, info->matrix_height, reinit);
+}
+
+static bool set_wled_address(const char *address)
+{
+    int af = AF_UNSPEC;
+    struct in_addr addr;
+    struct in6_addr addr6;
+    bool update = false;
+
+    if (inet_pton(AF_INET, address, &addr)) {
         af = AF_INET;
-    } else if (inet_pton(AF_INET6, wled_ip_new, &addr6)) {
+    } else if (inet_pton(AF_INET6, address, &addr6)) {
         af = AF_INET6;
     } else {
-        *wled_ip_new = '\0';
-        (void)pthread_mutex_unlock(&mutex);
-        return;
+        return false;
     }
 
     if (af != udp_sockaddr.ss_family) {
@@ -299,12 +548,87 @@ static void handle_wled_ip_async(void)
     }
 
     if (update) {
+        strncpy(wled_address, address, sizeof(wled_address) - 1);
+        telemetry_set_controller(wled_address);
+        last_udp_error_val = -1.0;
+        last_frame_val = -1.0;
+        connect_udp_socket();
+        wled_state_set_address(wled_address);
+    }
+
+    return update;
+}
+
+static void handle_wled_ip_async(void)
+{
+    struct wled_info info;
+    bool info_pending;
+
+    if (! *wled_ip_new)
+        return;
+
+    info = wled_info_new;
+    info_pending = wled_info_pending;
+    wled_info_pending = false;
+
+    if (set_wled_address(wled_ip_new)) {
         fprintf(stderr, "using wled controller from mdns: %s\n", wled_ip_new);
-        do_announce_my_ip();
+        if (! info_pending)
+            do_announce_my_ip();
     }
 
     *wled_ip_new = '\0';
-    (void)pthread_mutex_unlock(&mutex);
+
+    // A grid change restarts the games
+    if (info_pending) {
+        apply_wled_info(&info, true);
+        do_announce_my_ip();
+    }
+}
+
+static bool is_night(int hour)
+{
+    if (night_from <= night_to)
+        return hour >= night_from && hour < night_to;
+
+    return hour >= night_from || hour < night_to;
+}
+
+// Brightness and power are left to the controller, the frames stay untouched
+static void handle_wled_state(void)
+{
+    struct tm tm;
+    time_t now = time(NULL);
+    bool idle_off;
+    bool streaming;
+
+    if (! get_game()->idle_func())
+        last_activity_val = time_val;
+
+    idle_off = idle_off_secs > 0 && (time_val - last_activity_val) >= idle_off_secs;
+    if (idle_off != wled_idle_off) {
+        fprintf(stderr, "%s wled controller\n", idle_off ? "idle, turning off" : "active, turning on");
+        wled_idle_off = idle_off;
+        last_frame_val = -1.0;
+        wled_state_set_on(! idle_off);
+    }
+
+    // The worker keeps an eye on the live override while frames go out
+    streaming = display && ! wled_idle_off;
+    if (streaming != wled_streaming) {
+        wled_streaming = streaming;
+        wled_state_set_streaming(streaming);
+    }
+
+    if (brightness == 0 || now == last_state_check)
+        return;
+    last_state_check = now;
+
+    if (night_brightness > 0 && localtime_r(&now, &tm) && is_night(tm.tm_hour)) {
+        wled_state_set_brightness(night_brightness);
+    } else {
+        wled_state_set_brightness(brightness);
+    }
 }
 
 static void usage(void)
@@ -316,6 +640,8 @@ static void usage(void)
     fprintf(stderr, "  -a, --address\t\t\tWLED address\n");
     fprintf(stderr, "  -p, --port\t\t\tWLED port\n");
     fprintf(stderr, "  -m, --mdns-description\tWLED MDNS description\n");
+    fprintf(stderr, "  -c, --cache-file\t\tWLED controller cache file\n");
+    fprintf(stderr, "  -s, --score-file\t\thigh score file\n");
     fprintf(stderr, "  -j, --joystick-device\t\tjoystick device\n");
     fprintf(stderr, "  -u, --udev-hotplug\t\thotpluggable joystick devices\n");
     fprintf(stderr, "  -k, --keyboard\t\tkeyboard input\n");
@@ -323,6 +649,12 @@ static void usage(void)
     fprintf(stderr, "  -d, --debug\t\t\tdebug mode\n");
     fprintf(stderr, "  -S, --start\t\t\tstart game on startup\n");
     fprintf(stderr, "  -M, --mqtt\t\t\tenable MQTT\n");
+    fprintf(stderr, "  -n, --net-input\t\tnetwork gamepad UDP port\n");
+    fprintf(stderr, "  -F, --frame-port\t\tWLED/DDP frame ingest UDP port\n");
+    fprintf(stderr, "  -f, --framebuffer\t\tshared memory framebuffer path\n");
+    fprintf(stderr, "  -b, --brightness\t\tWLED brightness DAY[,NIGHT] (1-255)\n");
+    fprintf(stderr, "  -N, --night\t\t\tnight hours FROM-TO (default 23-7)\n");
+    fprintf(stderr, "  -i, --idle-off\t\tturn WLED off after idle minutes\n");
     fprintf(stderr, "  -h, --help\t\t\thelp\n");
     exit(EXIT_FAILURE);
 }
@@ -333,6 +665,8 @@ static struct option long_options[] = {
     {"address",             required_argument,  NULL,   'a'},
     {"port",                required_argument,  NULL,   'p'},
     {"mdns-description",    required_argument,  NULL,   'm'},
+    {"cache-file",          required_argument,  NULL,   'c'},
+    {"score-file",          required_argument,  NULL,   's'},
     {"joystick-device",     required_argument,  NULL,   'j'},
     {"udev-hotplug",        no_argument,        NULL,   'u'},
     {"keyboard",            no_argument,        NULL,   'k'},
@@ -340,6 +674,12 @@ static struct option long_options[] = {
     {"start",               no_argument,        NULL,   'S'},
     {"debug",               no_argument,        NULL,   'd'},
     {"mqtt",                no_argument,        NULL,   'M'},
+    {"net-input",           required_argument,  NULL,   'n'},
+    {"frame-port",          required_argument,  NULL,   'F'},
+    {"framebuffer",         required_argument,  NULL,   'f'},
+    {"brightness",          required_argument,  NULL,   'b'},
+    {"night",               required_argument,  NULL,   'N'},
+    {"idle-off",            required_argument,  NULL,   'i'},
     {"help",                no_argument,        NULL,   'h'},
     {NULL,                  0,                  NULL,   0}
 };
@@ -348,14 +688,21 @@ int main(int argc, char *argv[])
 {
     int c;
     size_t i;
+    char cached_address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+    struct wled_info wled_info;
+    uint64_t start_clock;
+    bool frame_due;
+    double anim_wait;
+    double wait_ms;
 
     for (;;) {
-        c = getopt_long(argc, argv, "W:H:a:p:m:j:ukg:dSMh", long_options, NULL);
+        c = getopt_long(argc, argv, "W:H:a:p:m:c:s:j:ukg:dSMn:F:f:b:N:i:h", long_options, NULL);
         if (c == -1)
             break;
 
         switch (c) {
             case 'W':
+                grid_auto = false;
                 grid_width = atoi(optarg);
                 if (grid_width < MIN_GRID_WIDTH || grid_width > MAX_GRID_WIDTH) {
                     fprintf(stderr, "Grid width must be within %d and %d\n", MIN_GRID_WIDTH, MAX_GRID_WIDTH);
@@ -364,6 +711,7 @@ int main(int argc, char *argv[])
                 break;
 
             case 'H':
+                grid_auto = false;
                 grid_height = atoi(optarg);
                 if (grid_height < MIN_GRID_HEIGHT || grid_height > MAX_GRID_HEIGHT) {
                     fprintf(stderr, "Grid height must be within %d and %d\n", MIN_GRID_HEIGHT, MAX_GRID_HEIGHT);
@@ -376,6 +724,7 @@ int main(int argc, char *argv[])
                 break;
 
             case 'p':
+                wled_port_auto = false;
                 wled_port = atoi(optarg);
                 if (wled_port <= 0 || wled_port >= 65536) {
                     fprintf(stderr, "WLED port must be within 1 and 65535\n");
@@ -387,6 +736,14 @@ int main(int argc, char *argv[])
                 mdns_description = optarg;
                 break;
 
+            case 'c':
+                cache_file = optarg;
+                break;
+
+            case 's':
+                score_file = optarg;
+                break;
+
             case 'j':
                 joypad_dev = optarg;
                 break;
@@ -400,13 +757,7 @@ int main(int argc, char *argv[])
                 break;
 
             case 'g':
-                start_game = -1;
-                for (i = 0; i < ARRAY_LENGTH(games); i++) {
-                    if (strcmp(games[i]->name, optarg) == 0) {
-                        start_game = i;
-                        break;
-                    }
-                }
+                start_game = find_game(optarg);
                 if (start_game == -1) {
                     fprintf(stderr, "Game \"%s\" not found.\n", optarg);
                     usage();
@@ -425,6 +776,50 @@ int main(int argc, char *argv[])
                 mqtt = true;
                 break;
 
+            case 'n':
+                net_input_port = atoi(optarg);
+                if (net_input_port <= 0 || net_input_port >= 65536) {
+                    fprintf(stderr, "Network input port must be within 1 and 65535\n");
+                    usage();
+                }
+                break;
+
+            case 'F':
+                frame_ingest_port = atoi(optarg);
+                if (frame_ingest_port <= 0 || frame_ingest_port >= 65536) {
+                    fprintf(stderr, "Frame ingest port must be within 1 and 65535\n");
+                    usage();
+                }
+                break;
+
+            case 'f':
+                framebuffer_path = optarg;
+                break;
+
+            case 'b':
+                if (sscanf(optarg, "%d,%d", &brightness, &night_brightness) < 1 ||
+                    brightness < 1 || brightness > 255 || night_brightness < 0 || night_brightness > 255) {
+                    fprintf(stderr, "Brightness must be within 1 and 255\n");
+                    usage();
+                }
+                break;
+
+            case 'N':
+                if (sscanf(optarg, "%d-%d", &night_from, &night_to) != 2 ||
+                    night_from < 0 || night_from > 23 || night_to < 0 || night_to > 23) {
+                    fprintf(stderr, "Night hours must be given as FROM-TO within 0 and 23\n");
+                    usage();
+                }
+                break;
+
+            case 'i':
+                idle_off_secs = atoi(optarg) * 60;
+                if (idle_off_secs <= 0) {
+                    fprintf(stderr, "Idle minutes must be positive\n");
+                    usage();
+                }
+                break;
+
             case 'h':
             case '?':
             default:
@@ -448,8 +843,8 @@ int main(int argc, char *argv[])
         usage();
     }
 
-    if (! joypad_dev && ! joypad_udev && ! keyboard) {
-        fprintf(stderr, "Either joystick device, hotpluggable joystick mode or keyboard mode must be used.\n");;
+    if (! joypad_dev && ! joypad_udev && ! keyboard && ! net_input_port) {
+        fprintf(stderr, "Either joystick device, hotpluggable joystick mode, keyboard mode or network input must be used.\n");;
         usage();
     }
 
@@ -460,30 +855,52 @@ int main(int argc, char *argv[])
 
     srand(time(NULL));
 
+    wled_api_init();
+    wled_state_init();
+
     memset(&udp_sockaddr, '\0', sizeof(udp_sockaddr));
     udp_sockaddr.ss_family = AF_UNSPEC;
     if (address) {
-        udp_sockaddr.ss_family = AF_INET;
-        ((struct sockaddr_in *)&udp_sockaddr)->sin_port = htons(wled_port);
-        ((struct sockaddr_in *)&udp_sockaddr)->sin_addr.s_addr = inet_addr(address);
+        if (! set_wled_address(address)) {
+            fprintf(stderr, "Invalid WLED address: %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+        if ((grid_auto || wled_port_auto) && wled_api_info(address, &wled_info)) {
+            apply_wled_info(&wled_info, false);
+        }
     } else {
         wled_ds = mdns_description;
-    }
 
-    udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp_fd == -1) {
-        perror("socket");
-        exit(EXIT_FAILURE);
+        // Start with the last verified controller, mdns revalidates it in the background
+        controller_cache_init(cache_file);
+        if (controller_cache_load(cached_address, sizeof(cached_address)) && set_wled_address(cached_address)) {
+            fprintf(stderr, "using cached wled controller: %s\n", cached_address);
+        }
     }
 
+    konami_seq = key_seq_register(konami_code, ARRAY_LENGTH(konami_code));
+
+    score_init(score_file);
+
+    loop_init();
+
     input_reset();
     if (joypad_dev) {
         init_joystick(joypad_dev);
     } else if (joypad_udev) {
         init_udev_hotplug();
-    } else {
+    } else if (keyboard) {
         init_keyboard();
     }
+    if (net_input_port) {
+        net_input_init(net_input_port);
+    }
+    if (frame_ingest_port) {
+        frame_ingest_init(frame_ingest_port);
+    }
+    if (framebuffer_path) {
+        shm_fb_init(framebuffer_path);
+    }
     joystick_cnt = count_joysticks();
 
     ip_init();
@@ -509,7 +926,7 @@ int main(int argc, char *argv[])
     if (start_game != -1)
         cur_game = start_game;
 
-    while (! get_game()->playable) {
+    while (! games[cur_game]->playable) {
         cur_game++;
         cur_game %= ARRAY_LENGTH(games);
     }
@@ -527,33 +944,55 @@ int main(int argc, char *argv[])
     }
 
     for (;;) {
+        // Input is limited per frame, wakeups in between only use what is left
+        time_val = get_time_val() - start_time_val;
+        frame_due = time_val >= next_frame_val;
+        if (frame_due) {
+            input_begin_frame();
+        }
+
         handle_input();
-        handle_announce_async();
+        handle_remote();
+        handle_announce_queue();
         handle_wled_ip_async();
 
-        time_val = get_time_val() - start_time_val;
-        if (get_game()->tick_freq > 0.0 && get_game()->tick_freq <= 1.0) {
-            while (time_val >= (last_tick_val + get_game()->tick_freq)) {
-                last_tick_val += get_game()->tick_freq;
-                ticks++;
-                if (get_game()->tick_func) {
-                    get_game()->tick_func();
+        // Wakeups in between only handle input, frames keep their own pace
+        if (frame_due) {
+            if (get_game()->tick_freq > 0.0 && get_game()->tick_freq <= 1.0) {
+                while (time_val >= (last_tick_val + get_game()->tick_freq)) {
+                    last_tick_val += get_game()->tick_freq;
+                    ticks++;
+                    if (get_game()->tick_func) {
+                        start_clock = telemetry_clock();
+                        get_game()->tick_func();
+                        telemetry_tick(telemetry_clock() - start_clock);
+                    }
                 }
             }
-        }
 
-        display = false;
-        if (get_game()->render_func) {
-            udp_data[0] = WLED_DRGB;
-            udp_data[1] = DISPLAY_TIMEOUT;
-            get_game()->render_func(&display, udp_data + 2);
-        }
-        if (display) {
-            if (udp_sockaddr.ss_family != AF_UNSPEC) {
-                (void)sendto(udp_fd, udp_data, UDP_DATA_SIZE, 0, (struct sockaddr *)&udp_sockaddr, sizeof(udp_sockaddr));
+            display = false;
+            if (get_game()->render_func) {
+                start_clock = telemetry_clock();
+                get_game()->render_func(&display, frame);
+                telemetry_render(telemetry_clock() - start_clock, display);
             }
+            telemetry_set_games(get_game()->name, games[cur_game]->name);
+            if (display && ! wled_idle_off && frame_changed()) {
+                send_udp_data();
+            }
+            handle_wled_state();
+
+            // Based on the frame just rendered, a late one does not shift the ones after it
+            next_frame_val = MAX(next_frame_val + FRAME_INTERVAL, time_val);
+
+            // Animations bring their own frame rate, the next one may be due earlier
+            if (get_game() == &animation_game && (anim_wait = animation_next_frame()) >= 0.0)
+                next_frame_val = MIN(next_frame_val, time_val + anim_wait);
         }
 
-        usleep(100000);
+        // Sleep until the next frame, input wakes us up early. Rounded up, a
+        // truncated timeout would spin through the last millisecond.
+        wait_ms = ceil(MIN(next_frame_val - (get_time_val() - start_time_val), FRAME_INTERVAL) * 1000.0);
+        loop_wait((int)MAX(wait_ms, 0.0));
     }
 }
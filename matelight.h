@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <linux/limits.h>
 
@@ -18,9 +19,9 @@
 #define DEFAULT_GRID_HEIGHT 12
 
 #define MIN_GRID_WIDTH  10
-#define MAX_GRID_WIDTH  20
+#define MAX_GRID_WIDTH  32
 #define MIN_GRID_HEIGHT 10
-#define MAX_GRID_HEIGHT 20
+#define MAX_GRID_HEIGHT 32
 
 // WLED
 #define WLED_WARLS      1
@@ -30,6 +31,11 @@
 
 // 490 is the maximum number of LEDs which can fit into 1472 bytes which is the max size of an unfragmented UDP datagram over IPv4 on 1500 MTU Ethernet
 #define WLED_DRGB_MAX_LEDS  490
+// DNRGB spends two more header bytes on the start index
+#define WLED_DNRGB_MAX_LEDS 489
+
+// Addresses checked at once by wled_api_probe_async() and wled_api_ping_async()
+#define WLED_PROBE_MAX      16
 
 #define MAX_GRID_SIZE       MAX(WLED_DRGB_MAX_LEDS, (MAX_GRID_WIDTH * MAX_GRID_HEIGHT))
 
@@ -62,6 +68,7 @@
 
 #define INPUT_KEYBOARD  0
 #define INPUT_JOYSTICK  1
+#define INPUT_NETWORK   2
 
 // Keys
 #define KEYPAD_NONE     0
@@ -75,7 +82,8 @@
 #define KEYPAD_A        (1 << 7)
 
 #define MAX_JOYSTICKS 64
-#define KEY_HISTORY_SIZE 16
+
+#define KEY_SEQ_NONE    -1
 
 struct joystick {
     int type;
@@ -88,13 +96,75 @@ struct joystick {
     char name[128];
 
     int player;
+    int net_pad;
 
     int key_state;
     int last_key_idx;
     bool last_key_val;
-    int key_history[KEY_HISTORY_SIZE];
+    int key_seq_state;
+    int key_seq_match;
+};
+
+struct input_stats {
+    unsigned long events;       // events handed to the games
+    unsigned long coalesced;    // redundant axis events
+    unsigned long deferred;     // frames in which the input budget ran out
+    unsigned long dropped;      // malformed, duplicated or overflowing network input
+};
+
+struct wled_stats {
+    unsigned long switches;         // active controller changed
+    unsigned long failures;         // verified controller went down
+    unsigned long recoveries;       // controller which was down answers again
+    unsigned long removals;         // verified controller withdrawn via mDNS
+    unsigned long icmp_errors;      // errors reported by the UDP sender
+    unsigned long ping_failures;
+    unsigned int candidates;        // verified and healthy controllers
+    bool active;                    // a healthy controller is in use
+};
+
+#define JSON_MAX_DEPTH      8
+#define JSON_MAX_PATH       96
+#define JSON_MAX_TOKEN      256     /* fits a whole announcement text */
+
+#define JSON_TYPE_STRING    0
+#define JSON_TYPE_NUMBER    1
+#define JSON_TYPE_TRUE      2
+#define JSON_TYPE_FALSE     3
+#define JSON_TYPE_NULL      4
+
+typedef void (*json_value_func)(const char *path, int type, const char *value, size_t len, void *arg);
+
+struct json_parser {
+    int state;
+    int depth;
+    char stack[JSON_MAX_DEPTH + 1];
+    unsigned int index[JSON_MAX_DEPTH + 1];
+    size_t path_base[JSON_MAX_DEPTH + 1];
+    char path[JSON_MAX_PATH];
+    size_t path_len;
+    char token[JSON_MAX_TOKEN];
+    size_t token_len;
+    bool escape;
+    int unicode_left;
+    unsigned int unicode;
+    json_value_func func;
+    void *arg;
 };
 
+struct wled_info {
+    char name[64];
+    char version[32];
+    int leds;                   // LED count, 0 if unknown
+    int matrix_width;           // 2D matrix size, 0 if not configured
+    int matrix_height;
+    int udp_port;               // realtime UDP port, 0 if unknown
+};
+
+// Results of the rounds run on the main loop, winner is -1 and info NULL if none matched
+typedef void (*wled_probe_func)(int winner, const struct wled_info *info, void *arg);
+typedef void (*wled_ping_func)(const bool *ok, const double *rtt_ms, void *arg);
+
 struct game {
     const char *name;
     bool playable;
@@ -107,6 +177,7 @@ struct game {
     void (*tick_func)();
     void (*render_func)(bool *display, char *screen);
     bool (*idle_func)(void);
+    bool yields_to_players;     // not shown while the current game is played
 };
 
 extern int grid_width;
@@ -117,16 +188,44 @@ extern double time_val;
 extern int ticks;
 
 extern const char *wled_ds;
-extern void update_wled_ip(const char *address);
+extern void update_wled_ip(const char *address, const struct wled_info *info);
 
 extern void do_announce(const char *text, unsigned int color, unsigned int bgcolor, double speed);
-extern void do_announce_async(char *text, unsigned int color, unsigned int bgcolor, double speed);
+
+#define ANNOUNCE_MAX_TEXT       256
+#define ANNOUNCE_PRIO_LOW       0
+#define ANNOUNCE_PRIO_NORMAL    1
+#define ANNOUNCE_PRIO_HIGH      2
+#define ANNOUNCE_TTL            10.0    /* seconds an announcement may wait */
+#define ANNOUNCE_FONT_NORMAL    0
+#define ANNOUNCE_FONT_BOLD      1
+#define ANNOUNCE_MAX_REPEAT     10
+#define ANNOUNCE_MAX_SPEED      50.0
+#define ANNOUNCE_MAX_TTL        3600.0
 
 extern const struct game announce_game;
-extern void set_announce_text(const char *text, unsigned int color, unsigned int bgcolor, double speed);
+extern void set_announce_text(const char *text, unsigned int color, unsigned int bgcolor, double speed, int font);
+extern bool announce_push(const char *text, unsigned int color, unsigned int bgcolor, double speed, int font, int priority, int repeat, double ttl);
+extern bool announce_show_next(void);
+extern unsigned long announce_dropped(void);
 
 extern const struct game debug_game;
 
+extern const struct game ingest_game;
+extern void frame_ingest_init(int port);
+extern unsigned long frame_ingest_dropped(void);
+
+extern const struct game framebuffer_game;
+extern void shm_fb_init(const char *path);
+
+extern const struct game animation_game;
+extern bool animation_load(const void *payload, size_t len);
+extern unsigned long animation_rejected(void);
+extern double animation_next_frame(void);
+
+extern const struct game ambient_game;
+extern bool ambient_set_status(const void *payload, size_t len);
+
 extern const struct game snake_game;
 extern const struct game tetris_game;
 extern const struct game flappy_game;
@@ -134,19 +233,123 @@ extern const struct game pong_game;
 extern const struct game breakout_game;
 extern const struct game invaders_game;
 
+typedef void (*loop_fd_func)(int fd, unsigned int events, void *arg);
+extern void loop_init(void);
+extern bool loop_add_fd(int fd, unsigned int events, loop_fd_func func, void *arg);
+extern void loop_mod_fd(int fd, unsigned int events);
+extern void loop_del_fd(int fd);
+extern int loop_add_timer(loop_fd_func func, void *arg);
+extern void loop_set_timer(int fd, long timeout_ms);
+extern void loop_del_timer(int fd);
+extern void loop_wait(int timeout_ms);
+extern void loop_wakeup(void);
+
 extern char ip_address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
 extern void ip_init(void);
+extern void json_init(struct json_parser *p, json_value_func func, void *arg);
+extern bool json_feed(struct json_parser *p, const char *data, size_t len);
+extern bool json_finish(struct json_parser *p);
 extern void mdns_init(void);
+extern void mdns_report_failure(const char *address);
+extern void mdns_get_stats(struct wled_stats *wled_stats);
+extern void controller_cache_init(const char *path);
+extern bool controller_cache_load(char *address, size_t size);
+extern bool controller_cache_address(char *address, size_t size);
+extern void controller_cache_store(const char *address);
 extern void input_reset(void);
 extern void init_joystick(const char *devnode);
 extern void init_udev_hotplug(void);
 extern void init_keyboard(void);
+extern struct joystick *add_virtual_joystick(int type, int fd, const char *devnode, const char *name);
+extern void remove_virtual_joystick(struct joystick *joystick);
+extern void input_begin_frame(void);
 extern bool read_joystick(struct joystick **joystick_ptr);
+extern void input_get_stats(struct input_stats *input_stats);
 extern int count_joysticks(void);
-extern bool joystick_is_key_seq(struct joystick *joystick, const int *seq, size_t seq_length);
+extern int count_players(void);
+extern int joystick_key_seq(struct joystick *joystick);
+extern int key_seq_register(const int *seq, size_t seq_length);
+extern int key_seq_advance(int state, int key_idx, int *match);
 extern bool has_player(int player);
+extern void net_input_init(int port);
+extern void net_input_expire(void);
+extern bool net_input_read(struct joystick *joystick);
+extern unsigned long net_input_dropped(void);
+
+#define MQTT_MAX_TOPICS     16
+
+struct mqtt_stats {
+    unsigned long received;     // messages from the broker
+    unsigned long announced;    // messages queued as announcements
+    unsigned long rejected;     // malformed JSON announcements
+    unsigned long duplicates;   // same topic and payload within the dedup window
+    unsigned long rate_limited; // over the rate of their subscription
+    unsigned long reconnects;   // failed connects and lost connections
+};
+
+struct mqtt_topic {
+    char filter[128];
+    unsigned int color;
+    unsigned int bgcolor;
+    double speed;
+    int font;
+    int priority;
+    double ttl;
+};
+
 extern void mqtt_init(void);
-extern bool wled_api_check(const char *addr);
+extern bool mqtt_publish(const char *topic, const void *payload, size_t len, bool retain);
+extern void mqtt_get_stats(struct mqtt_stats *mqtt_stats);
+extern void mqtt_topics_load(const char *path);
+extern const struct mqtt_topic *mqtt_topic_get(size_t index);
+extern const struct mqtt_topic *mqtt_topic_match(const char *topic);
+extern int mqtt_parse_priority(const char *str);
+extern int mqtt_parse_font(const char *str);
+
+#define REMOTE_GAME         0
+#define REMOTE_DEMO         1
+#define REMOTE_STOP         2
+#define REMOTE_KEY          3
+
+#define REMOTE_MAX_PLAYERS  4
+
+struct remote_command {
+    int type;
+    char game[32];
+    int player;
+    int key_idx;
+    bool key_val;
+};
+
+extern bool remote_command(const char *command, const void *payload, size_t len);
+extern bool remote_pop(struct remote_command *cmd);
+extern unsigned long remote_dropped(void);
+
+#define SCORE_TOP_N         10
+
+extern void score_init(const char *path);
+extern void score_submit(const char *game, unsigned int score);
+extern size_t score_top(const char *game, unsigned int *scores, size_t max_scores);
+extern void mqtt_publish_score(const char *game, unsigned int score, int rank);
+
+extern void telemetry_init(const char *topic, int interval);
+extern uint64_t telemetry_clock(void);
+extern void telemetry_tick(uint64_t us);
+extern void telemetry_render(uint64_t us, bool display);
+extern void telemetry_frame_sent(size_t bytes);
+extern void telemetry_set_games(const char *shown, const char *selected);
+extern void telemetry_set_controller(const char *address);
+extern void wled_api_init(void);
+extern bool wled_api_info(const char *addr, struct wled_info *info);
+extern bool wled_api_state(const char *addr, const char *json);
+extern bool wled_api_live_override(const char *addr, int *lor);
+extern void wled_state_init(void);
+extern void wled_state_set_address(const char *address);
+extern void wled_state_set_on(bool on);
+extern void wled_state_set_brightness(int bri);
+extern void wled_state_set_streaming(bool on);
+extern bool wled_api_probe_async(const char * const *addrs, size_t num_addrs, wled_probe_func func, void *arg);
+extern bool wled_api_ping_async(const char * const *addrs, size_t num_addrs, wled_ping_func func, void *arg);
 
 // Set pixel
 static inline void set_pixel(char *screen, int y, int x, unsigned int color)
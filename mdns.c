@@ -5,38 +5,610 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
-#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 
 #include <avahi-client/client.h>
 #include <avahi-client/lookup.h>
-#include <avahi-common/simple-watch.h>
+#include <avahi-common/watch.h>
+#include <avahi-common/domain.h>
+#include <avahi-common/timeval.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/error.h>
 
 #include "matelight.h"
 
+#define MAX_WLED_SERVERS    32
+#define MDNS_RETRY_DELAY    5
+#define MDNS_PROBE_DELAY_MS 50  /* collect simultaneously resolved services into one probe round */
+
+#define HEALTH_TICK_MS          250
+#define WLED_PING_INTERVAL      5   /* seconds between pings of the active controller */
+#define WLED_STANDBY_INTERVAL   30  /* seconds between pings of verified standby controllers */
+#define WLED_PING_MISSES        2   /* missed pings before a controller counts as down */
+#define WLED_BACKOFF_MIN        1   /* retry interval for controllers which are down, doubled up to the max */
+#define WLED_BACKOFF_MAX        60
+
+#define WLED_UNKNOWN        0
+#define WLED_VERIFIED       1
+#define WLED_REJECTED       2
+
 struct wled_server {
+    bool used;
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    char name[AVAHI_LABEL_MAX];
+    char domain[AVAHI_DOMAIN_NAME_MAX];
+    AvahiServiceResolver *resolver;
     char address[AVAHI_ADDRESS_STR_MAX];
-    bool is_wled;
+    int state;
+    bool cached;                // seeded from the controller cache, not discovered
+    bool healthy;               // only meaningful once verified
+    int misses;
+    unsigned int failures;
+    int backoff;
+    double next_ping;
+    double rtt_ms;
+    struct wled_info info;
+};
+
+/*
+ * Probes and pings run on the main loop one round at a time and the servers
+ * may change meanwhile. The addresses are kept here for the round, a result
+ * only counts for a server which still has that address.
+ */
+struct check_round {
+    bool running;
+    size_t num;
+    struct wled_server *servers[WLED_PROBE_MAX];
+    char addresses[WLED_PROBE_MAX][AVAHI_ADDRESS_STR_MAX];
+    const char *addrs[WLED_PROBE_MAX];
+};
+
+/*
+ * Avahi runs on the main loop: the watches and timeouts of the client (its
+ * D-Bus connection) and of this file are registered with loop.c. D-Bus may
+ * watch one descriptor for reading and writing separately, epoll takes it
+ * only once, so every watch registers its own dup() of it.
+ */
+struct AvahiWatch {
+    int fd;
+    int loop_fd;
+    AvahiWatchEvent revents;
+    AvahiWatchCallback callback;
+    void *userdata;
+};
+
+struct AvahiTimeout {
+    int loop_fd;
+    AvahiTimeoutCallback callback;
+    void *userdata;
 };
 
-static pthread_t mdns_thread;
-static AvahiSimplePoll *simple_poll = NULL;
 static AvahiClient *client = NULL;
 static AvahiServiceBrowser *sb = NULL;
-static bool all_for_now = false;
-static size_t n_resolvers = 0;
-static struct wled_server *wled_servers = NULL;
-static size_t num_wled_servers = 0;
+static struct wled_server wled_servers[MAX_WLED_SERVERS];
+static struct wled_server *cur_wled_server = NULL;
+static AvahiTimeout *probe_timeout = NULL;
+static AvahiTimeout *health_timeout = NULL;
+static int restart_fd = -1;
+static struct check_round cur_round;
+static bool probe_pending = false;
+
+static char failed_address[AVAHI_ADDRESS_STR_MAX] = { 0 };
+static struct wled_stats stats = { 0 };
+
+static void probe_callback(AvahiTimeout *t, void *userdata);
+
+static unsigned int to_loop_events(AvahiWatchEvent event)
+{
+    unsigned int events = 0;
+
+    if (event & AVAHI_WATCH_IN)
+        events |= EPOLLIN;
+    if (event & AVAHI_WATCH_OUT)
+        events |= EPOLLOUT;
+
+    return events;
+}
+
+static AvahiWatchEvent to_watch_events(unsigned int events)
+{
+    int event = 0;
+
+    if (events & EPOLLIN)
+        event |= AVAHI_WATCH_IN;
+    if (events & EPOLLOUT)
+        event |= AVAHI_WATCH_OUT;
+    if (events & EPOLLERR)
+        event |= AVAHI_WATCH_ERR;
+    if (events & EPOLLHUP)
+        event |= AVAHI_WATCH_HUP;
+
+    return (AvahiWatchEvent)event;
+}
+
+// The callback may free the watch
+static void watch_func(int fd, unsigned int events, void *arg)
+{
+    AvahiWatch *w = arg;
+
+    (void)fd;
+
+    w->revents = to_watch_events(events);
+    w->callback(w, w->fd, w->revents, w->userdata);
+}
+
+static AvahiWatch *watch_new(const AvahiPoll *api, int fd, AvahiWatchEvent event, AvahiWatchCallback callback, void *userdata)
+{
+    AvahiWatch *w;
+
+    (void)api;
+
+    w = calloc(1, sizeof(*w));
+    if (! w)
+        return NULL;
+
+    w->fd = fd;
+    w->callback = callback;
+    w->userdata = userdata;
+    w->loop_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (w->loop_fd == -1 || ! loop_add_fd(w->loop_fd, to_loop_events(event), watch_func, w)) {
+        if (w->loop_fd != -1)
+            close(w->loop_fd);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+static void watch_update(AvahiWatch *w, AvahiWatchEvent event)
+{
+    loop_mod_fd(w->loop_fd, to_loop_events(event));
+}
+
+static AvahiWatchEvent watch_get_events(AvahiWatch *w)
+{
+    return w->revents;
+}
+
+static void watch_free(AvahiWatch *w)
+{
+    loop_del_fd(w->loop_fd);
+    close(w->loop_fd);
+    free(w);
+}
+
+// Avahi times are absolute, NULL disables the timeout
+static long timeout_ms(const struct timeval *tv)
+{
+    AvahiUsec usec;
+
+    if (! tv)
+        return -1;
+
+    usec = -avahi_age(tv);
+    return usec > 0 ? (long)((usec + 999) / 1000) : 0;
+}
+
+// The callback may free or rearm the timeout
+static void timeout_func(int fd, unsigned int events, void *arg)
+{
+    AvahiTimeout *t = arg;
+
+    (void)fd;
+    (void)events;
+
+    t->callback(t, t->userdata);
+}
+
+static AvahiTimeout *timeout_new(const AvahiPoll *api, const struct timeval *tv, AvahiTimeoutCallback callback, void *userdata)
+{
+    AvahiTimeout *t;
+
+    (void)api;
+
+    t = calloc(1, sizeof(*t));
+    if (! t)
+        return NULL;
+
+    t->callback = callback;
+    t->userdata = userdata;
+    t->loop_fd = loop_add_timer(timeout_func, t);
+    if (t->loop_fd == -1) {
+        free(t);
+        return NULL;
+    }
+    loop_set_timer(t->loop_fd, timeout_ms(tv));
+
+    return t;
+}
+
+static void timeout_update(AvahiTimeout *t, const struct timeval *tv)
+{
+    loop_set_timer(t->loop_fd, timeout_ms(tv));
+}
+
+static void timeout_free(AvahiTimeout *t)
+{
+    loop_del_timer(t->loop_fd);
+    free(t);
+}
+
+static const AvahiPoll loop_poll = {
+    NULL,
+    watch_new,
+    watch_update,
+    watch_get_events,
+    watch_free,
+    timeout_new,
+    timeout_update,
+    timeout_free,
+};
+
+static double get_monotonic(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static struct wled_server *find_wled_server(AvahiIfIndex interface, AvahiProtocol protocol, const char *name, const char *domain)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(wled_servers); i++) {
+        if (wled_servers[i].used && ! wled_servers[i].cached && wled_servers[i].interface == interface && wled_servers[i].protocol == protocol && strcmp(wled_servers[i].name, name) == 0 && strcmp(wled_servers[i].domain, domain) == 0)
+            return &wled_servers[i];
+    }
+
+    return NULL;
+}
+
+static void schedule_probe(void)
+{
+    struct timeval tv;
+
+    avahi_elapse_time(&tv, MDNS_PROBE_DELAY_MS, 0);
+    if (probe_timeout) {
+        loop_poll.timeout_update(probe_timeout, &tv);
+    } else {
+        probe_timeout = loop_poll.timeout_new(&loop_poll, &tv, probe_callback, NULL);
+    }
+}
+
+static void round_add(struct wled_server *server)
+{
+    cur_round.servers[cur_round.num] = server;
+    memcpy(cur_round.addresses[cur_round.num], server->address, sizeof(cur_round.addresses[cur_round.num]));
+    cur_round.addrs[cur_round.num] = cur_round.addresses[cur_round.num];
+    cur_round.num++;
+}
+
+static bool round_matches(size_t i, int state)
+{
+    const struct wled_server *server = cur_round.servers[i];
+
+    return server->used && server->state == state && strcmp(server->address, cur_round.addresses[i]) == 0;
+}
+
+static void round_done(void)
+{
+    cur_round.running = false;
+
+    // A probe which came in while the round was running
+    if (probe_pending) {
+        probe_pending = false;
+        schedule_probe();
+    }
+}
+
+static bool is_candidate(const struct wled_server *server)
+{
+    return server->used && server->state == WLED_VERIFIED && server->healthy;
+}
+
+// Discovered before cached, then the fewest failures, then the fastest
+static bool rank_better(const struct wled_server *a, const struct wled_server *b)
+{
+    if (a->cached != b->cached)
+        return ! a->cached;
+    if (a->failures != b->failures)
+        return a->failures < b->failures;
+    return a->rtt_ms < b->rtt_ms;
+}
+
+static void update_stats(void)
+{
+    size_t i;
+    unsigned int candidates = 0;
+
+    for (i = 0; i < ARRAY_LENGTH(wled_servers); i++) {
+        if (is_candidate(&wled_servers[i]))
+            candidates++;
+    }
+
+    stats.candidates = candidates;
+    stats.active = cur_wled_server != NULL;
+}
+
+static void select_wled_server(void)
+{
+    struct wled_server *best = NULL;
+    size_t i;
+
+    // Stick with a healthy controller, switching back and forth makes the display flicker
+    if (cur_wled_server && is_candidate(cur_wled_server) && ! cur_wled_server->cached) {
+        update_stats();
+        return;
+    }
+
+    for (i = 0; i < ARRAY_LENGTH(wled_servers); i++) {
+        if (is_candidate(&wled_servers[i]) && (! best || rank_better(&wled_servers[i], best)))
+            best = &wled_servers[i];
+    }
+
+    if (best && ! best->cached) {
+        // A discovered controller replaces the cached one for good
+        for (i = 0; i < ARRAY_LENGTH(wled_servers); i++) {
+            if (wled_servers[i].used && wled_servers[i].cached)
+                memset(&wled_servers[i], '\0', sizeof(wled_servers[i]));
+        }
+    }
+
+    if (best && best != cur_wled_server) {
+        if (best->cached) {
+            fprintf(stderr, "mdns: Using cached WLED at %s\n", best->address);
+        } else {
+            fprintf(stderr, "mdns: Using WLED '%s' at %s\n", best->name, best->address);
+        }
+        update_wled_ip(best->address, &best->info);
+        if (! best->cached)
+            controller_cache_store(best->address);
+        stats.switches++;
+    } else if (! best && cur_wled_server) {
+        // Keep sending to the last one, there is nothing better to switch to
+        fprintf(stderr, "mdns: No healthy WLED left\n");
+    }
+    cur_wled_server = best;
+    update_stats();
+
+    // Look for more candidates among whatever has not been probed yet
+    schedule_probe();
+}
+
+static void mark_unhealthy(struct wled_server *server, const char *reason)
+{
+    if (! server->healthy)
+        return;
+
+    fprintf(stderr, "mdns: WLED '%s' at %s is down (%s)\n", server->name, server->address, reason);
+
+    server->healthy = false;
+    server->misses = 0;
+    server->failures++;
+    server->backoff = WLED_BACKOFF_MIN;
+    server->next_ping = get_monotonic() + server->backoff;
+    stats.failures++;
+
+    if (server == cur_wled_server)
+        cur_wled_server = NULL;
+}
+
+static void ping_result(const bool *ok, const double *rtt_ms, void *arg)
+{
+    struct wled_server *server;
+    double now = get_monotonic();
+    bool reselect = false;
+    size_t i;
+
+    (void)arg;
+
+    round_done();
+
+    for (i = 0; i < cur_round.num; i++) {
+        if (! round_matches(i, WLED_VERIFIED))
+            continue;
+        server = cur_round.servers[i];
+
+        if (ok[i]) {
+            server->rtt_ms = rtt_ms[i];
+            server->misses = 0;
+            if (! server->healthy) {
+                fprintf(stderr, "mdns: WLED '%s' at %s is back\n", server->name, server->address);
+                server->healthy = true;
+                server->backoff = 0;
+                stats.recoveries++;
+                reselect = true;
+            }
+            server->next_ping = now + (server == cur_wled_server ? WLED_PING_INTERVAL : WLED_STANDBY_INTERVAL);
+            continue;
+        }
+
+        stats.ping_failures++;
+        if (server->healthy) {
+            server->next_ping = now + WLED_BACKOFF_MIN;
+            if (++server->misses >= WLED_PING_MISSES) {
+                mark_unhealthy(server, "ping");
+                reselect = true;
+            }
+        } else {
+            server->backoff = MIN(server->backoff * 2, WLED_BACKOFF_MAX);
+            server->next_ping = now + server->backoff;
+        }
+    }
+
+    if (reselect)
+        select_wled_server();
+}
+
+static void handle_failure(void)
+{
+    // Reports for a controller we already moved away from are stale
+    if (*failed_address && cur_wled_server && strcmp(cur_wled_server->address, failed_address) == 0) {
+        mark_unhealthy(cur_wled_server, "icmp");
+        select_wled_server();
+    }
+
+    *failed_address = '\0';
+}
+
+static void health_callback(AvahiTimeout *t, void *userdata)
+{
+    struct timeval tv;
+    double now = get_monotonic();
+    size_t i;
+
+    (void)userdata;
+
+    handle_failure();
+
+    // A round still running keeps the servers due until the next tick
+    if (! cur_round.running) {
+        cur_round.num = 0;
+        for (i = 0; i < ARRAY_LENGTH(wled_servers) && cur_round.num < WLED_PROBE_MAX; i++) {
+            if (wled_servers[i].used && wled_servers[i].state == WLED_VERIFIED && wled_servers[i].next_ping <= now)
+                round_add(&wled_servers[i]);
+        }
+
+        if (cur_round.num > 0)
+            cur_round.running = wled_api_ping_async(cur_round.addrs, cur_round.num, ping_result, NULL);
+    }
+
+    avahi_elapse_time(&tv, HEALTH_TICK_MS, 0);
+    loop_poll.timeout_update(t, &tv);
+}
+
+static void probe_result(int winner, const struct wled_info *info, void *arg)
+{
+    struct wled_server *server;
+    size_t i;
+
+    (void)arg;
+
+    round_done();
+
+    if (winner == -1) {
+        // All of them answered or timed out without a match
+        for (i = 0; i < cur_round.num; i++) {
+            if (! round_matches(i, WLED_UNKNOWN))
+                continue;
+            cur_round.servers[i]->state = WLED_REJECTED;
+            if (cur_round.servers[i]->cached)
+                fprintf(stderr, "mdns: Cached WLED at %s did not verify\n", cur_round.addresses[i]);
+        }
+        return;
+    }
+
+    // The others were cancelled and stay unknown, they are probed in the next round
+    if (! round_matches(winner, WLED_UNKNOWN)) {
+        schedule_probe();
+        return;
+    }
+
+    server = cur_round.servers[winner];
+    server->state = WLED_VERIFIED;
+    server->info = *info;
+    server->healthy = true;
+    server->misses = 0;
+    server->next_ping = get_monotonic() + WLED_PING_INTERVAL;
+    select_wled_server();
+}
+
+static void probe_callback(AvahiTimeout *t, void *userdata)
+{
+    size_t i;
+
+    (void)userdata;
+
+    // Disarm, the timeout is rearmed by the next schedule_probe()
+    loop_poll.timeout_update(t, NULL);
+
+    if (cur_round.running) {
+        probe_pending = true;
+        return;
+    }
+
+    cur_round.num = 0;
+    for (i = 0; i < ARRAY_LENGTH(wled_servers) && cur_round.num < WLED_PROBE_MAX; i++) {
+        if (wled_servers[i].used && *wled_servers[i].address && wled_servers[i].state == WLED_UNKNOWN)
+            round_add(&wled_servers[i]);
+    }
+
+    if (cur_round.num == 0)
+        return;
+
+    cur_round.running = wled_api_probe_async(cur_round.addrs, cur_round.num, probe_result, NULL);
+    if (! cur_round.running)
+        fprintf(stderr, "mdns: Failed to start probing\n");
+}
+
+static void remove_wled_server(struct wled_server *server)
+{
+    if (server->state == WLED_VERIFIED)
+        stats.removals++;
+
+    if (server->resolver)
+        avahi_service_resolver_free(server->resolver);
+
+    memset(server, '\0', sizeof(*server));
+
+    if (server == cur_wled_server) {
+        cur_wled_server = NULL;
+        select_wled_server();
+    }
+}
+
+static void remove_wled_servers(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(wled_servers); i++) {
+        if (wled_servers[i].used && wled_servers[i].resolver)
+            avahi_service_resolver_free(wled_servers[i].resolver);
+    }
+
+    memset(wled_servers, '\0', sizeof(wled_servers));
+    cur_wled_server = NULL;
+    update_stats();
+}
+
+// The client is replaced after a while, see restart_func()
+static void schedule_restart(void)
+{
+    loop_set_timer(restart_fd, MDNS_RETRY_DELAY * 1000);
+}
+
+static void add_cached_wled_server(void)
+{
+    struct wled_server *server = &wled_servers[0];
+
+    // Called on an empty table, the cached controller is revalidated in the first probe round
+    if (! controller_cache_address(server->address, sizeof(server->address)))
+        return;
+
+    server->used = true;
+    server->cached = true;
+    server->interface = AVAHI_IF_UNSPEC;
+    server->protocol = AVAHI_PROTO_UNSPEC;
+    strncpy(server->name, "cache", sizeof(server->name) - 1);
+    server->state = WLED_UNKNOWN;
+
+    schedule_probe();
+}
 
 static void resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, AvahiProtocol protocol, AvahiResolverEvent event, const char *name, const char *type, const char *domain, const char *host_name, const AvahiAddress *address, uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags, void* userdata) {
     char a[AVAHI_ADDRESS_STR_MAX];
     char *t;
-    struct wled_server *new_wled_servers;
+    struct wled_server *server = userdata;
 
     (void)interface;
     (void)protocol;
-    (void)userdata;
 
     assert(r);
 
@@ -62,59 +634,77 @@ static void resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, Av
                         !!(flags & AVAHI_LOOKUP_RESULT_CACHED));
                 avahi_free(t);
             }
-            if (wled_servers) {
-                new_wled_servers = realloc(wled_servers, sizeof(struct wled_server) * (num_wled_servers + 1));
-            } else {
-                new_wled_servers = malloc(sizeof(struct wled_server));
-            }
-            if (new_wled_servers) {
-                memcpy(&new_wled_servers[num_wled_servers].address, a, sizeof(a));
-                new_wled_servers[num_wled_servers].is_wled = false;
-                wled_servers = new_wled_servers;
-                num_wled_servers++;
+
+            // The resolver stays around and reports address changes, only probe new addresses
+            if (strcmp(server->address, a) != 0) {
+                memcpy(server->address, a, sizeof(server->address));
+                server->state = WLED_UNKNOWN;
+                server->healthy = false;
+                if (server == cur_wled_server) {
+                    cur_wled_server = NULL;
+                }
+                select_wled_server();
             }
+            break;
         }
     }
-    avahi_service_resolver_free(r);
-
-    n_resolvers--;
-    if (all_for_now && n_resolvers == 0) {
-        avahi_simple_poll_quit(simple_poll);
-    }
 }
 
 static void browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface, AvahiProtocol protocol, AvahiBrowserEvent event, const char *name, const char *type, const char *domain, AVAHI_GCC_UNUSED AvahiLookupResultFlags flags, void *userdata) {
     AvahiClient *c = userdata;
+    struct wled_server *server;
+    size_t i;
 
     assert(b);
 
     switch (event) {
         case AVAHI_BROWSER_FAILURE:
             fprintf(stderr, "mdns: (Browser) %s\n", avahi_strerror(avahi_client_errno(avahi_service_browser_get_client(b))));
-            avahi_simple_poll_quit(simple_poll);
+            schedule_restart();
             return;
 
         case AVAHI_BROWSER_NEW:
             fprintf(stderr, "mdns: (Browser) NEW: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
-            n_resolvers++;
-            if (! avahi_service_resolver_new(c, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, 0, resolve_callback, c)) {
+            if (find_wled_server(interface, protocol, name, domain))
+                break;
+
+            server = NULL;
+            for (i = 0; i < ARRAY_LENGTH(wled_servers); i++) {
+                if (! wled_servers[i].used) {
+                    server = &wled_servers[i];
+                    break;
+                }
+            }
+            if (! server) {
+                fprintf(stderr, "mdns: Too many services, ignoring '%s'\n", name);
+                break;
+            }
+
+            memset(server, '\0', sizeof(*server));
+            server->used = true;
+            server->interface = interface;
+            server->protocol = protocol;
+            strncpy(server->name, name, sizeof(server->name) - 1);
+            strncpy(server->domain, domain, sizeof(server->domain) - 1);
+
+            server->resolver = avahi_service_resolver_new(c, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, 0, resolve_callback, server);
+            if (! server->resolver) {
                 fprintf(stderr, "mdns: Failed to resolve service '%s': %s\n", name, avahi_strerror(avahi_client_errno(c)));
-			}
+                server->used = false;
+            }
             break;
 
         case AVAHI_BROWSER_REMOVE:
             fprintf(stderr, "mdns: (Browser) REMOVE: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
+            server = find_wled_server(interface, protocol, name, domain);
+            if (server) {
+                remove_wled_server(server);
+            }
             break;
 
         case AVAHI_BROWSER_ALL_FOR_NOW:
         case AVAHI_BROWSER_CACHE_EXHAUSTED:
             fprintf(stderr, "mdns: (Browser) %s\n", event == AVAHI_BROWSER_CACHE_EXHAUSTED ? "CACHE_EXHAUSTED" : "ALL_FOR_NOW");
-            if (event == AVAHI_BROWSER_ALL_FOR_NOW) {
-                all_for_now = true;
-                if (all_for_now && n_resolvers == 0) {
-                    avahi_simple_poll_quit(simple_poll);
-                }
-            }
             break;
     }
 }
@@ -122,87 +712,112 @@ static void browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface, Avah
 static void client_callback(AvahiClient *c, AvahiClientState state, AVAHI_GCC_UNUSED void *userdata) {
 	assert(c);
 
-    if (state == AVAHI_CLIENT_FAILURE) {
-        fprintf(stderr, "mdns: Server connection failure: %s\n", avahi_strerror(avahi_client_errno(c)));
-        avahi_simple_poll_quit(simple_poll);
-    }
-}
-
-static void *mdns_thread_func(void *arg)
-{
-    int error;
-    size_t i;
-
-    (void)arg;
+    switch (state) {
+        case AVAHI_CLIENT_S_RUNNING:
+            if (sb)
+                break;
 
-    fprintf(stderr, "mdns: Initializing.\n");
+            fprintf(stderr, "mdns: Browsing.\n");
+            sb = avahi_service_browser_new(c, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "_wled._tcp", NULL, 0, browse_callback, c);
+            if (! sb) {
+                fprintf(stderr, "mdns: Failed to create service browser: %s\n", avahi_strerror(avahi_client_errno(c)));
+                schedule_restart();
+            }
+            break;
 
-    for (;;) {
-        fprintf(stderr, "mdns: Browsing.\n");
+        case AVAHI_CLIENT_CONNECTING:
+            // The daemon went away, browser and resolvers are gone with it. Keep using the current controller meanwhile.
+            fprintf(stderr, "mdns: Waiting for daemon.\n");
+            if (sb) {
+                avahi_service_browser_free(sb);
+                sb = NULL;
+            }
+            remove_wled_servers();
+            break;
 
-        all_for_now = false;
-        n_resolvers = 0;
+        case AVAHI_CLIENT_FAILURE:
+            fprintf(stderr, "mdns: Server connection failure: %s\n", avahi_strerror(avahi_client_errno(c)));
+            schedule_restart();
+            break;
 
-        simple_poll = avahi_simple_poll_new();
-        if (! simple_poll) {
-            fprintf(stderr, "mdns: Failed to create simple poll object.\n");
-            return NULL;
-        }
+        default:
+            break;
+    }
+}
 
-        client = avahi_client_new(avahi_simple_poll_get(simple_poll), AVAHI_CLIENT_NO_FAIL, client_callback, NULL, &error);
-        if (! client) {
-            fprintf(stderr, "mdns: Failed to create client: %s\n", avahi_strerror(error));
-            avahi_simple_poll_free(simple_poll);
-            return NULL;
-        }
+static void start_client(void)
+{
+    int error;
 
-        sb = avahi_service_browser_new(client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "_wled._tcp", NULL, 0, browse_callback, client);
-        if (! sb) {
-            fprintf(stderr, "mdns: Failed to create service browser: %s\n", avahi_strerror(avahi_client_errno(client)));
-            avahi_client_free(client);
-            avahi_simple_poll_free(simple_poll);
-            return NULL;
-        }
+    // One long lived client and browser, NEW and REMOVE events update the server table as they come in
+    client = avahi_client_new(&loop_poll, AVAHI_CLIENT_NO_FAIL, client_callback, NULL, &error);
+    if (! client) {
+        fprintf(stderr, "mdns: Failed to create client: %s\n", avahi_strerror(error));
+        schedule_restart();
+        return;
+    }
 
-        avahi_simple_poll_loop(simple_poll);
+    add_cached_wled_server();
+}
 
+static void stop_client(void)
+{
+    remove_wled_servers();
+    if (sb) {
         avahi_service_browser_free(sb);
+        sb = NULL;
+    }
+    if (client) {
         avahi_client_free(client);
-        avahi_simple_poll_free(simple_poll);
+        client = NULL;
+    }
+}
 
-        for (i = 0; i < num_wled_servers; i++) {
-            if (wled_api_check(wled_servers[i].address)) {
-                wled_servers[i].is_wled = true;
-            }
-        }
+// Not from the Avahi callbacks, they must not free the client they are called for
+static void restart_func(int fd, unsigned int events, void *arg)
+{
+    (void)fd;
+    (void)events;
+    (void)arg;
 
-        for (i = 0; i < num_wled_servers; i++) {
-            if (wled_servers[i].is_wled) {
-                update_wled_ip(wled_servers[i].address);
-                break;
-            }
-        }
+    stop_client();
+    start_client();
+}
 
-        if (wled_servers) {
-            free(wled_servers);
-        }
-        wled_servers = NULL;
-        num_wled_servers = 0;
+// Called from the sender when the active controller produced an ICMP error
+void mdns_report_failure(const char *address)
+{
+    struct timeval tv;
 
-        sleep(60);
-    }
+    if (! health_timeout)
+        return;
 
-    fprintf(stderr, "mdns: Done.\n");
+    strncpy(failed_address, address, sizeof(failed_address) - 1);
+    stats.icmp_errors++;
 
-    return NULL;
+    // Handled right after the frame went out, not in the middle of sending it
+    avahi_elapse_time(&tv, 0, 0);
+    loop_poll.timeout_update(health_timeout, &tv);
+}
+
+void mdns_get_stats(struct wled_stats *wled_stats)
+{
+    *wled_stats = stats;
 }
 
 void mdns_init(void)
 {
-    if (pthread_create(&mdns_thread, NULL, mdns_thread_func, NULL) != 0) {
-        perror("pthread_create");
+    struct timeval tv;
+
+    fprintf(stderr, "mdns: Initializing.\n");
+
+    restart_fd = loop_add_timer(restart_func, NULL);
+    avahi_elapse_time(&tv, HEALTH_TICK_MS, 0);
+    health_timeout = loop_poll.timeout_new(&loop_poll, &tv, health_callback, NULL);
+    if (restart_fd == -1 || ! health_timeout) {
+        fprintf(stderr, "mdns: Failed to set up timers.\n");
         return;
     }
 
-    (void)pthread_detach(mdns_thread);
+    start_client();
 }
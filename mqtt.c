@@ -1,25 +1,170 @@
+#define _GNU_SOURCE
+
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
-#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <mosquitto.h>
 
 #include "matelight.h"
 
-#define MQTT_TOPIC "hackeriet/ding"
 #define CA_CERTIFICATES "/etc/ssl/certs/ca-certificates.crt"
 
+// Reconnect delays, doubled after every failure and picked at random from the upper half
+#define MQTT_BACKOFF_MIN    1.0
+#define MQTT_BACKOFF_MAX    300.0
+#define MQTT_KEEPALIVE      60
+#define MQTT_MISC_INTERVAL  1000    /* ms between keepalive checks */
+
+// Longer messages are not worth parsing, the text is limited anyway
+#define MQTT_MAX_JSON   1024
+
+/*
+ * Flood protection for announcement topics, before anything is parsed or
+ * queued: a message seen within the dedup window (same topic and payload) is
+ * dropped, the rest takes a token from the bucket of its subscription.
+ */
+#define MQTT_RATE_BURST     5
+#define MQTT_DEDUP_WINDOW   10.0    /* seconds */
+#define MQTT_DEDUP_SIZE     16
+
+struct token_bucket {
+    double tokens;
+    double last;
+};
+
+struct recent_message {
+    uint64_t hash;
+    double seen;
+};
+
+/*
+ * JSON announcements, missing fields come from the topic:
+ *
+ *   {"text": "...", "fg": "#rrggbb", "bg": "#rrggbb", "speed": 5.0, "font": "bold",
+ *    "priority": "high", "repeat": 2, "ttl": 60}
+ */
+struct announce_request {
+    char text[ANNOUNCE_MAX_TEXT];
+    unsigned int color;
+    unsigned int bgcolor;
+    double speed;
+    int font;
+    int priority;
+    int repeat;
+    double ttl;
+    bool valid;
+};
+
 static const char *mqtt_server = "localhost";
 static int mqtt_port = 1883;
 static bool mqtt_tls = false;
 static const char *mqtt_username = NULL;
 static const char *mqtt_password = NULL;
-
-static pthread_t mqtt_thread;
+static const char *mqtt_animation_topic = NULL;
+static const char *mqtt_status_topic = NULL;
+static const char *mqtt_command_prefix = NULL;
+static const char *mqtt_score_topic = NULL;
+static const char *mqtt_telemetry_topic = NULL;
+static double mqtt_rate_limit = 30.0;   /* messages per minute and subscription */
+static int mqtt_telemetry_interval = 60;
+
+/*
+ * The client runs on the main loop: its socket is registered while there is
+ * a connection, with write interest only while libmosquitto has something
+ * queued. One timer does the keepalive checks while connected and waits out
+ * the backoff otherwise. The broker name is looked up by getaddrinfo_a(),
+ * which wakes the loop through an eventfd, and connected to by address.
+ */
 static struct mosquitto *mosq;
+static bool connected = false;
+static int mqtt_fd = -1;
+static int timer_fd = -1;
+static int resolve_fd = -1;
+static struct gaicb resolve_req;
+static struct addrinfo resolve_hints;
+static double backoff_delay = MQTT_BACKOFF_MIN;
+static unsigned int backoff_seed = 0;
+
+static struct mqtt_stats stats = { 0 };
+static struct token_bucket buckets[MQTT_MAX_TOPICS];
+static struct recent_message recent[MQTT_DEDUP_SIZE];
+static unsigned int recent_pos = 0;
+
+static void update_events(void);
+
+void mqtt_get_stats(struct mqtt_stats *mqtt_stats)
+{
+    *mqtt_stats = stats;
+}
+
+bool mqtt_publish(const char *topic, const void *payload, size_t len, bool retain)
+{
+    int rc;
+
+    if (! connected)
+        return false;
+
+    // Written right away as far as the socket takes it, the rest once it is writable
+    rc = mosquitto_publish(mosq, NULL, topic, len, payload, 0, retain);
+    update_events();
+    if (rc != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "mqtt: Error publishing %s: %s\n", topic, mosquitto_strerror(rc));
+        return false;
+    }
+
+    return true;
+}
+
+// Appends at *len, false once the result does not fit into buf anymore
+static bool append_printf(char *buf, size_t size, int *len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n >= size - *len)
+        return false;
+
+    *len += n;
+    return true;
+}
+
+void mqtt_publish_score(const char *game, unsigned int score, int rank)
+{
+    unsigned int top[SCORE_TOP_N];
+    char payload[64 + (SCORE_TOP_N * 12)];
+    size_t i, num;
+    int len = 0;
+
+    if (! mqtt_score_topic)
+        return;
+
+    num = score_top(game, top, ARRAY_LENGTH(top));
+    if (! append_printf(payload, sizeof(payload), &len, "{\"game\":\"%s\",\"score\":%u,\"rank\":%d,\"top\":[", game, score, rank))
+        return;
+    for (i = 0; i < num; i++) {
+        if (! append_printf(payload, sizeof(payload), &len, "%s%u", i > 0 ? "," : "", top[i]))
+            return;
+    }
+    if (! append_printf(payload, sizeof(payload), &len, "]}"))
+        return;
+
+    (void)mqtt_publish(mqtt_score_topic, payload, len, false);
+}
 
 static void on_log(struct mosquitto *mosq, void *obj, int level, const char *str)
 {
@@ -31,6 +176,9 @@ static void on_log(struct mosquitto *mosq, void *obj, int level, const char *str
 
 static void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
 {
+    const struct mqtt_topic *topic;
+    char filter[256];
+    size_t i;
     int rc;
 
     (void)obj;
@@ -41,12 +189,53 @@ static void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
         return;
     }
 
-    rc = mosquitto_subscribe(mosq, NULL, MQTT_TOPIC, 1);
-    if (rc != MOSQ_ERR_SUCCESS) {
-        fprintf(stderr, "mqtt: Error subscribing: %s\n", mosquitto_strerror(rc));
-        mosquitto_disconnect(mosq);
-        return;
+    for (i = 0; (topic = mqtt_topic_get(i)) != NULL; i++) {
+        rc = mosquitto_subscribe(mosq, NULL, topic->filter, 1);
+        if (rc != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "mqtt: Error subscribing %s: %s\n", topic->filter, mosquitto_strerror(rc));
+            mosquitto_disconnect(mosq);
+            return;
+        }
+    }
+
+    if (mqtt_animation_topic) {
+        rc = mosquitto_subscribe(mosq, NULL, mqtt_animation_topic, 0);
+        if (rc != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "mqtt: Error subscribing: %s\n", mosquitto_strerror(rc));
+            mosquitto_disconnect(mosq);
+            return;
+        }
+    }
+
+    if (mqtt_command_prefix) {
+        snprintf(filter, sizeof(filter), "%s/#", mqtt_command_prefix);
+        rc = mosquitto_subscribe(mosq, NULL, filter, 1);
+        if (rc != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "mqtt: Error subscribing %s: %s\n", filter, mosquitto_strerror(rc));
+            mosquitto_disconnect(mosq);
+            return;
+        }
     }
+
+    if (mqtt_status_topic) {
+        rc = mosquitto_subscribe(mosq, NULL, mqtt_status_topic, 1);
+        if (rc != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "mqtt: Error subscribing %s: %s\n", mqtt_status_topic, mosquitto_strerror(rc));
+            mosquitto_disconnect(mosq);
+            return;
+        }
+    }
+
+    connected = true;
+}
+
+static void on_disconnect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    (void)mosq;
+    (void)obj;
+
+    fprintf(stderr, "mqtt: on_disconnect: %d\n", reason_code);
+    connected = false;
 }
 
 static void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
@@ -99,63 +288,405 @@ static void strip_garbage(char *text)
         *garbage = '\0';
 }
 
+static double get_monotonic_time(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static bool is_duplicate(const struct mosquitto_message *msg, double now)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    hash = hash_bytes(hash, msg->topic, strlen(msg->topic) + 1);
+    hash = hash_bytes(hash, msg->payload, msg->payloadlen);
+
+    for (i = 0; i < ARRAY_LENGTH(recent); i++) {
+        if (recent[i].hash == hash && recent[i].seen > 0.0 && now - recent[i].seen < MQTT_DEDUP_WINDOW)
+            return true;
+    }
+
+    recent[recent_pos].hash = hash;
+    recent[recent_pos].seen = now;
+    recent_pos = (recent_pos + 1) % ARRAY_LENGTH(recent);
+
+    return false;
+}
+
+static bool take_token(const struct mqtt_topic *topic, double now)
+{
+    struct token_bucket *bucket = &buckets[topic - mqtt_topic_get(0)];
+
+    if (mqtt_rate_limit <= 0.0)
+        return true;
+
+    if (bucket->last == 0.0) {
+        bucket->tokens = MQTT_RATE_BURST;
+    } else {
+        bucket->tokens = MIN(bucket->tokens + ((now - bucket->last) * mqtt_rate_limit / 60.0), MQTT_RATE_BURST);
+    }
+    bucket->last = now;
+
+    if (bucket->tokens < 1.0)
+        return false;
+
+    bucket->tokens -= 1.0;
+    return true;
+}
+
+static bool parse_color(int type, const char *value, unsigned int *color)
+{
+    unsigned long val;
+    char *end;
+
+    if (type == JSON_TYPE_STRING) {
+        if (*value == '#')
+            value++;
+        if (strlen(value) != 6)
+            return false;
+        val = strtoul(value, &end, 16);
+    } else if (type == JSON_TYPE_NUMBER) {
+        val = strtoul(value, &end, 10);
+    } else {
+        return false;
+    }
+
+    if (*end != '\0' || val > 0xffffff)
+        return false;
+
+    *color = val;
+    return true;
+}
+
+static bool parse_number(int type, const char *value, double min, double max, double *number)
+{
+    if (type != JSON_TYPE_NUMBER)
+        return false;
+
+    *number = strtod(value, NULL);
+    return *number >= min && *number <= max;
+}
+
+static void announce_value(const char *path, int type, const char *value, size_t len, void *arg)
+{
+    struct announce_request *req = arg;
+    double number = 0.0;
+    bool ok = true;
+
+    if (strcmp(path, "text") == 0) {
+        ok = type == JSON_TYPE_STRING;
+        memcpy(req->text, value, MIN(len, sizeof(req->text) - 1));
+        req->text[MIN(len, sizeof(req->text) - 1)] = '\0';
+    } else if (strcmp(path, "fg") == 0) {
+        ok = parse_color(type, value, &req->color);
+    } else if (strcmp(path, "bg") == 0) {
+        ok = parse_color(type, value, &req->bgcolor);
+    } else if (strcmp(path, "speed") == 0) {
+        ok = parse_number(type, value, 0.1, ANNOUNCE_MAX_SPEED, &req->speed);
+    } else if (strcmp(path, "font") == 0) {
+        req->font = type == JSON_TYPE_STRING ? mqtt_parse_font(value) : -1;
+        ok = req->font != -1;
+    } else if (strcmp(path, "priority") == 0) {
+        req->priority = type == JSON_TYPE_STRING ? mqtt_parse_priority(value) : -1;
+        ok = req->priority != -1;
+    } else if (strcmp(path, "repeat") == 0) {
+        ok = parse_number(type, value, 1, ANNOUNCE_MAX_REPEAT, &number);
+        req->repeat = (int)number;
+    } else if (strcmp(path, "ttl") == 0) {
+        ok = parse_number(type, value, 1, ANNOUNCE_MAX_TTL, &req->ttl);
+    }
+
+    // Unknown fields are left for newer senders
+    if (! ok)
+        req->valid = false;
+}
+
+// Parsed straight from the payload, nothing is allocated
+static bool parse_announce_json(const struct mqtt_topic *topic, const char *payload, size_t len, struct announce_request *req)
+{
+    struct json_parser parser;
+
+    if (len > MQTT_MAX_JSON)
+        return false;
+
+    memset(req, '\0', sizeof(*req));
+    req->color = topic->color;
+    req->bgcolor = topic->bgcolor;
+    req->speed = topic->speed;
+    req->font = topic->font;
+    req->priority = topic->priority;
+    req->repeat = 1;
+    req->ttl = topic->ttl;
+    req->valid = true;
+
+    json_init(&parser, announce_value, req);
+    if (! json_feed(&parser, payload, len) || ! json_finish(&parser))
+        return false;
+
+    return req->valid && *req->text;
+}
+
+static bool is_json(const char *payload, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len && (payload[i] == ' ' || payload[i] == '\t' || payload[i] == '\r' || payload[i] == '\n'); i++)
+        ;
+
+    return i < len && payload[i] == '{';
+}
+
 static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
 {
-    char *text;
+    const struct mqtt_topic *topic;
+    struct announce_request req;
+    double now;
+    size_t len;
     (void)mosq;
     (void)obj;
 
+    stats.received++;
+
+    // Binary, decoded right out of the message
+    if (msg->topic && mqtt_animation_topic && strcmp(msg->topic, mqtt_animation_topic) == 0) {
+        fprintf(stderr, "mqtt: on_message: %s %d %d bytes\n", msg->topic, msg->qos, msg->payloadlen);
+        (void)animation_load(msg->payload, msg->payloadlen);
+        return;
+    }
+
+    if (msg->topic && mqtt_status_topic && strcmp(msg->topic, mqtt_status_topic) == 0) {
+        fprintf(stderr, "mqtt: on_message: %s %d %d:%.*s\n", msg->topic, msg->qos, msg->payloadlen, msg->payloadlen, (char *)msg->payload);
+        (void)ambient_set_status(msg->payload, msg->payloadlen);
+        return;
+    }
+
+    // Commands are not deduplicated, pressing a key twice is fine
+    len = mqtt_command_prefix ? strlen(mqtt_command_prefix) : 0;
+    if (msg->topic && len > 0 && strncmp(msg->topic, mqtt_command_prefix, len) == 0 && msg->topic[len] == '/') {
+        fprintf(stderr, "mqtt: on_message: %s %d %d:%.*s\n", msg->topic, msg->qos, msg->payloadlen, msg->payloadlen, (char *)msg->payload);
+        (void)remote_command(msg->topic + len + 1, msg->payload, msg->payloadlen);
+        return;
+    }
+
+    topic = mqtt_topic_match(msg->topic);
+    if (! topic || msg->payloadlen <= 0)
+        return;
+
+    // Floods are dropped before they are logged, parsed or queued
+    now = get_monotonic_time();
+    if (is_duplicate(msg, now)) {
+        stats.duplicates++;
+        return;
+    }
+    if (! take_token(topic, now)) {
+        stats.rate_limited++;
+        return;
+    }
+
     fprintf(stderr, "mqtt: on_message: %s %d %d:%.*s\n", msg->topic, msg->qos, msg->payloadlen, msg->payloadlen, (char *)msg->payload);
 
-    if (msg->topic && strcmp(msg->topic, MQTT_TOPIC) == 0 && msg->payloadlen > 0) {
-        text = malloc(msg->payloadlen + 1);
-        if (text) {
-            memcpy(text, msg->payload, msg->payloadlen);
-            text[msg->payloadlen] = '\0';
-            strip_garbage(text);
-            do_announce_async(text, COLOR_BLACK, COLOR_YELLOW, 5.0);
+    if (is_json(msg->payload, msg->payloadlen)) {
+        if (! parse_announce_json(topic, msg->payload, msg->payloadlen, &req)) {
+            fprintf(stderr, "mqtt: rejected malformed announcement on %s\n", msg->topic);
+            stats.rejected++;
+            return;
         }
+    } else {
+        // Plain text keeps the colours of the topic
+        len = MIN((size_t)msg->payloadlen, sizeof(req.text) - 1);
+        memcpy(req.text, msg->payload, len);
+        req.text[len] = '\0';
+        strip_garbage(req.text);
+        req.color = topic->color;
+        req.bgcolor = topic->bgcolor;
+        req.speed = topic->speed;
+        req.font = topic->font;
+        req.priority = topic->priority;
+        req.repeat = 1;
+        req.ttl = topic->ttl;
     }
+
+    if (announce_push(req.text, req.color, req.bgcolor, req.speed, req.font, req.priority, req.repeat, req.ttl))
+        stats.announced++;
 }
 
-static void *mqtt_thread_func(void *arg)
+// Read and write interest follow what libmosquitto has queued
+static void update_events(void)
 {
-    int rc;
+    if (mqtt_fd != -1)
+        loop_mod_fd(mqtt_fd, EPOLLIN | (mosquitto_want_write(mosq) ? EPOLLOUT : 0));
+}
 
+static void schedule_retry(int rc)
+{
+    double wait;
+
+    // libmosquitto may have closed the socket already
+    if (mqtt_fd != -1) {
+        loop_del_fd(mqtt_fd);
+        mqtt_fd = -1;
+    }
+    connected = false;
+    (void)mosquitto_disconnect(mosq);
+
+    wait = (backoff_delay / 2.0) + ((backoff_delay / 2.0) * rand_r(&backoff_seed) / RAND_MAX);
+    fprintf(stderr, "mqtt: %s:%d: %s, retrying in %.1f seconds\n", mqtt_server, mqtt_port, mosquitto_strerror(rc), wait);
+    stats.reconnects++;
+    loop_set_timer(timer_fd, (long)(wait * 1000.0));
+    backoff_delay = MIN(backoff_delay * 2.0, MQTT_BACKOFF_MAX);
+}
+
+// libmosquitto closes the socket itself when the connection is lost or we disconnected
+static bool check_connection(int rc)
+{
+    if (rc == MOSQ_ERR_SUCCESS && mosquitto_socket(mosq) != mqtt_fd)
+        rc = MOSQ_ERR_CONN_LOST;
+
+    if (rc != MOSQ_ERR_SUCCESS) {
+        schedule_retry(rc);
+        return false;
+    }
+
+    update_events();
+    return true;
+}
+
+static void socket_func(int fd, unsigned int events, void *arg)
+{
+    int rc = MOSQ_ERR_SUCCESS;
+
+    (void)fd;
     (void)arg;
 
-    mosquitto_lib_init();
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        rc = mosquitto_loop_read(mosq, 1);
+    if (rc == MOSQ_ERR_SUCCESS && (events & EPOLLOUT) && mosquitto_socket(mosq) == mqtt_fd)
+        rc = mosquitto_loop_write(mosq, 1);
 
-    mosq = mosquitto_new(NULL, true, NULL);
-    if (! mosq) {
-        mosquitto_lib_cleanup();
-        return NULL;
+    (void)check_connection(rc);
+}
+
+static void connect_host(const char *host)
+{
+    int rc;
+
+    // A numeric address, libmosquitto sets up the connection in the background
+    rc = mosquitto_connect_async(mosq, host, mqtt_port, MQTT_KEEPALIVE);
+    if (rc == MOSQ_ERR_SUCCESS) {
+        mqtt_fd = mosquitto_socket(mosq);
+        if (mqtt_fd == -1 || ! loop_add_fd(mqtt_fd, EPOLLIN | EPOLLOUT, socket_func, NULL)) {
+            mqtt_fd = -1;
+            rc = MOSQ_ERR_NO_CONN;
+        }
     }
 
-    mosquitto_log_callback_set(mosq, on_log);
-    mosquitto_connect_callback_set(mosq, on_connect);
-    mosquitto_subscribe_callback_set(mosq, on_subscribe);
-    mosquitto_message_callback_set(mosq, on_message);
+    if (rc != MOSQ_ERR_SUCCESS) {
+        schedule_retry(rc);
+        return;
+    }
 
-    if (mqtt_tls) {
-        mosquitto_tls_set(mosq, CA_CERTIFICATES, NULL, NULL, NULL, NULL);
-        mosquitto_tls_insecure_set(mosq, true);
+    update_events();
+    loop_set_timer(timer_fd, MQTT_MISC_INTERVAL);
+}
+
+// Runs on a thread of getaddrinfo_a(), only wakes the main loop
+static void resolve_notify(union sigval sv)
+{
+    uint64_t val = 1;
+
+    (void)sv;
+
+    (void)write(resolve_fd, &val, sizeof(val));
+}
+
+static void resolve_func(int fd, unsigned int events, void *arg)
+{
+    char host[NI_MAXHOST];
+    uint64_t val;
+    int rc;
+
+    (void)events;
+    (void)arg;
+
+    (void)read(fd, &val, sizeof(val));
+
+    rc = gai_error(&resolve_req);
+    if (rc == EAI_INPROGRESS)
+        return;
+
+    if (rc == 0) {
+        rc = getnameinfo(resolve_req.ar_result->ai_addr, resolve_req.ar_result->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+        freeaddrinfo(resolve_req.ar_result);
+        resolve_req.ar_result = NULL;
     }
-    if (mqtt_username && *mqtt_username) {
-        mosquitto_username_pw_set(mosq, mqtt_username, (mqtt_password && *mqtt_password) ? mqtt_password : NULL);
+
+    if (rc != 0) {
+        fprintf(stderr, "mqtt: %s: %s\n", mqtt_server, gai_strerror(rc));
+        schedule_retry(MOSQ_ERR_EAI);
+        return;
     }
-    rc = mosquitto_connect(mosq, mqtt_server, mqtt_port, 60);
-    if (rc != MOSQ_ERR_SUCCESS){
-        mosquitto_destroy(mosq);
-        fprintf(stderr, "mqtt: %s\n", mosquitto_strerror(rc));
-        mosquitto_lib_cleanup();
-        return NULL;
+
+    connect_host(host);
+}
+
+static void connect_broker(void)
+{
+    struct gaicb *reqs[1] = { &resolve_req };
+    struct sigevent sev;
+    int rc;
+
+    memset(&resolve_hints, '\0', sizeof(resolve_hints));
+    resolve_hints.ai_family = AF_UNSPEC;
+    resolve_hints.ai_socktype = SOCK_STREAM;
+
+    memset(&resolve_req, '\0', sizeof(resolve_req));
+    resolve_req.ar_name = mqtt_server;
+    resolve_req.ar_request = &resolve_hints;
+
+    memset(&sev, '\0', sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = resolve_notify;
+
+    // A slow DNS server must not hold up the display, resolve_func() goes on
+    rc = getaddrinfo_a(GAI_NOWAIT, reqs, ARRAY_LENGTH(reqs), &sev);
+    if (rc != 0) {
+        fprintf(stderr, "mqtt: %s: %s\n", mqtt_server, gai_strerror(rc));
+        schedule_retry(MOSQ_ERR_EAI);
+    }
+}
+
+static void timer_func(int fd, unsigned int events, void *arg)
+{
+    (void)fd;
+    (void)events;
+    (void)arg;
+
+    if (mqtt_fd == -1) {
+        connect_broker();
+        return;
     }
 
-    mosquitto_loop_forever(mosq, -1, 1);
+    if (connected)
+        backoff_delay = MQTT_BACKOFF_MIN;
 
-    mosquitto_lib_cleanup();
-    return NULL;
+    if (check_connection(mosquitto_loop_misc(mosq)))
+        loop_set_timer(timer_fd, MQTT_MISC_INTERVAL);
 }
 
 static void mqtt_configure(void)
@@ -200,16 +731,105 @@ static void mqtt_configure(void)
     } else {
         mqtt_password = NULL;
     }
+
+    mqtt_topics_load(getenv("MQTT_TOPICS"));
+
+    str = getenv("MQTT_ANIMATION_TOPIC");
+    if (str && *str) {
+        mqtt_animation_topic = str;
+    } else {
+        mqtt_animation_topic = NULL;
+    }
+
+    str = getenv("MQTT_STATUS_TOPIC");
+    if (str && *str) {
+        mqtt_status_topic = str;
+    } else {
+        mqtt_status_topic = NULL;
+    }
+
+    str = getenv("MQTT_COMMAND_TOPIC");
+    if (str && *str && strlen(str) < 200) {
+        mqtt_command_prefix = str;
+    } else {
+        mqtt_command_prefix = NULL;
+    }
+
+    str = getenv("MQTT_SCORE_TOPIC");
+    if (str && *str) {
+        mqtt_score_topic = str;
+    } else {
+        mqtt_score_topic = NULL;
+    }
+
+    str = getenv("MQTT_RATE_LIMIT");
+    if (str && *str) {
+        mqtt_rate_limit = atof(str);
+    } else {
+        mqtt_rate_limit = 30.0;
+    }
+
+    str = getenv("MQTT_TELEMETRY_TOPIC");
+    if (str && *str) {
+        mqtt_telemetry_topic = str;
+    } else {
+        mqtt_telemetry_topic = NULL;
+    }
+
+    str = getenv("MQTT_TELEMETRY_INTERVAL");
+    if (str && *str) {
+        mqtt_telemetry_interval = atoi(str);
+    } else {
+        mqtt_telemetry_interval = 60;
+    }
 }
 
 void mqtt_init(void)
 {
     mqtt_configure();
+    telemetry_init(mqtt_telemetry_topic, mqtt_telemetry_interval);
+
+    mosquitto_lib_init();
+
+    mosq = mosquitto_new(NULL, true, NULL);
+    if (! mosq) {
+        fprintf(stderr, "mqtt: Failed to create client\n");
+        mosquitto_lib_cleanup();
+        return;
+    }
+
+    mosquitto_log_callback_set(mosq, on_log);
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_disconnect_callback_set(mosq, on_disconnect);
+    mosquitto_subscribe_callback_set(mosq, on_subscribe);
+    mosquitto_message_callback_set(mosq, on_message);
 
-    if (pthread_create(&mqtt_thread, NULL, mqtt_thread_func, NULL) != 0) {
-        perror("pthread_create");
+    if (mqtt_tls) {
+        mosquitto_tls_set(mosq, CA_CERTIFICATES, NULL, NULL, NULL, NULL);
+        mosquitto_tls_insecure_set(mosq, true);
+    }
+    if (mqtt_username && *mqtt_username) {
+        mosquitto_username_pw_set(mosq, mqtt_username, (mqtt_password && *mqtt_password) ? mqtt_password : NULL);
+    }
+
+    timer_fd = loop_add_timer(timer_func, NULL);
+    if (timer_fd == -1) {
+        mosquitto_destroy(mosq);
+        mosquitto_lib_cleanup();
+        return;
+    }
+
+    resolve_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resolve_fd == -1 || ! loop_add_fd(resolve_fd, EPOLLIN, resolve_func, NULL)) {
+        perror("mqtt: eventfd");
+        if (resolve_fd != -1)
+            close(resolve_fd);
+        loop_del_timer(timer_fd);
+        mosquitto_destroy(mosq);
+        mosquitto_lib_cleanup();
         return;
     }
 
-    (void)pthread_detach(mqtt_thread);
+    backoff_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    connect_broker();
 }
@@ -0,0 +1,415 @@
+/* network virtual gamepads */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "matelight.h"
+
+/*
+ * Packet format (all integers in network byte order):
+ *
+ *   0  'M' 'J'         magic
+ *   2  u8              version (1)
+ *   3  u8              number of events
+ *   4  u32             sequence number, increasing per sender
+ *   8  { u8, u8 } *    events: pad number, opcode
+ *
+ * Opcodes: 0x80 | n presses and 0x00 | n releases key (1 << n), see KEYPAD_*,
+ * 0x40 registers the pad (hello), 0x41 unregisters it (bye). Pads are also
+ * registered implicitly by their first key event. A packet without events
+ * keeps all pads of the sender alive.
+ *
+ * Every packet which registers a pad is answered with a packet in the same
+ * format, echoing the sequence number, with one { pad number, player } pair
+ * per registered pad of the sender.
+ */
+
+#define NET_INPUT_MAGIC_0           'M'
+#define NET_INPUT_MAGIC_1           'J'
+#define NET_INPUT_VERSION           1
+#define NET_INPUT_HEADER_SIZE       8
+#define NET_INPUT_MAX_EVENTS        255
+#define NET_INPUT_PACKET_SIZE       (NET_INPUT_HEADER_SIZE + (NET_INPUT_MAX_EVENTS * 2))
+
+#define NET_OP_PRESS                0x80
+#define NET_OP_HELLO                0x40
+#define NET_OP_BYE                  0x41
+#define NET_OP_KEY_MASK             0x07
+
+#define NET_INPUT_MAX_CLIENTS       16
+#define NET_INPUT_MAX_PADS          16
+#define NET_INPUT_PADS_PER_CLIENT   4
+#define NET_PAD_QUEUE_SIZE          64 /* must be a power of two */
+#define NET_INPUT_MAX_PACKETS       32 /* per wakeup */
+
+#define NET_INPUT_TIMEOUT           30.0
+
+struct net_client {
+    bool used;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint32_t seq;
+    double last_seen;
+    int pads[NET_INPUT_PADS_PER_CLIENT];
+};
+
+struct net_pad {
+    bool used;
+    struct joystick *joystick;
+    unsigned char queue[NET_PAD_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int tail;
+};
+
+static int net_fd = -1;
+static struct net_client clients[NET_INPUT_MAX_CLIENTS] = { 0 };
+static struct net_pad pads[NET_INPUT_MAX_PADS] = { 0 };
+static double last_expire = 0.0;
+
+static unsigned long dropped_packets = 0;
+static unsigned long dropped_events = 0;
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static bool same_addr(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+
+    if (a->ss_family != b->ss_family)
+        return false;
+
+    if (a->ss_family == AF_INET)
+        return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+
+    if (a->ss_family == AF_INET6)
+        return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+
+    return false;
+}
+
+static void format_addr(const struct sockaddr_storage *addr, char *buf, size_t size)
+{
+    char host[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)] = { 0 };
+
+    if (addr->ss_family == AF_INET) {
+        (void)inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, host, sizeof(host));
+        snprintf(buf, size, "%s:%d", host, ntohs(((const struct sockaddr_in *)addr)->sin_port));
+    } else if (addr->ss_family == AF_INET6) {
+        (void)inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, host, sizeof(host));
+        snprintf(buf, size, "[%s]:%d", host, ntohs(((const struct sockaddr_in6 *)addr)->sin6_port));
+    } else {
+        snprintf(buf, size, "unknown");
+    }
+}
+
+static struct net_client *get_client(const struct sockaddr_storage *addr, socklen_t addrlen, bool create)
+{
+    size_t i, j;
+    struct net_client *client = NULL;
+
+    for (i = 0; i < ARRAY_LENGTH(clients); i++) {
+        if (clients[i].used && same_addr(&clients[i].addr, addr))
+            return &clients[i];
+        if (! clients[i].used && ! client)
+            client = &clients[i];
+    }
+
+    if (! create || ! client)
+        return NULL;
+
+    memset(client, '\0', sizeof(*client));
+    client->used = true;
+    memcpy(&client->addr, addr, addrlen);
+    client->addrlen = addrlen;
+    for (j = 0; j < ARRAY_LENGTH(client->pads); j++)
+        client->pads[j] = -1;
+
+    return client;
+}
+
+static struct net_pad *add_pad(struct net_client *client, unsigned int pad_nr)
+{
+    size_t i;
+    struct net_pad *pad = NULL;
+    char name[16 + MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+    char devnode[32 + sizeof(name)];
+
+    if (client->pads[pad_nr] != -1)
+        return &pads[client->pads[pad_nr]];
+
+    for (i = 0; i < ARRAY_LENGTH(pads); i++) {
+        if (! pads[i].used) {
+            pad = &pads[i];
+            break;
+        }
+    }
+    if (! pad) {
+        dropped_events++;
+        return NULL;
+    }
+
+    format_addr(&client->addr, name, sizeof(name));
+    snprintf(devnode, sizeof(devnode), "udp://%s/%u", name, pad_nr);
+
+    pad->joystick = add_virtual_joystick(INPUT_NETWORK, net_fd, devnode, "network");
+    if (! pad->joystick) {
+        dropped_events++;
+        return NULL;
+    }
+
+    pad->used = true;
+    pad->head = 0;
+    pad->tail = 0;
+    pad->joystick->net_pad = pad - pads;
+    client->pads[pad_nr] = pad - pads;
+
+    fprintf(stderr, "netinput: added pad %s (player: %d)\n", devnode, pad->joystick->player);
+
+    return pad;
+}
+
+static void remove_pad(struct net_client *client, unsigned int pad_nr)
+{
+    struct net_pad *pad;
+
+    if (client->pads[pad_nr] == -1)
+        return;
+
+    pad = &pads[client->pads[pad_nr]];
+    fprintf(stderr, "netinput: removed pad %s\n", pad->joystick->devnode);
+
+    remove_virtual_joystick(pad->joystick);
+    pad->joystick = NULL;
+    pad->used = false;
+    client->pads[pad_nr] = -1;
+}
+
+static void remove_client(struct net_client *client)
+{
+    unsigned int pad_nr;
+
+    for (pad_nr = 0; pad_nr < NET_INPUT_PADS_PER_CLIENT; pad_nr++) {
+        remove_pad(client, pad_nr);
+    }
+    client->used = false;
+}
+
+static void send_reply(struct net_client *client, uint32_t seq)
+{
+    unsigned char reply[NET_INPUT_HEADER_SIZE + (NET_INPUT_PADS_PER_CLIENT * 2)];
+    unsigned int pad_nr;
+    size_t len = NET_INPUT_HEADER_SIZE;
+
+    reply[0] = NET_INPUT_MAGIC_0;
+    reply[1] = NET_INPUT_MAGIC_1;
+    reply[2] = NET_INPUT_VERSION;
+    reply[3] = 0;
+    seq = htonl(seq);
+    memcpy(&reply[4], &seq, sizeof(seq));
+
+    for (pad_nr = 0; pad_nr < NET_INPUT_PADS_PER_CLIENT; pad_nr++) {
+        if (client->pads[pad_nr] == -1)
+            continue;
+        reply[len++] = pad_nr;
+        reply[len++] = pads[client->pads[pad_nr]].joystick->player;
+        reply[3]++;
+    }
+
+    (void)sendto(net_fd, reply, len, 0, (struct sockaddr *)&client->addr, client->addrlen);
+}
+
+static void handle_packet(const unsigned char *data, size_t len, const struct sockaddr_storage *addr, socklen_t addrlen, double now)
+{
+    struct net_client *client;
+    struct net_pad *pad;
+    uint32_t seq;
+    size_t i, num_events;
+    unsigned int pad_nr, op;
+    bool reply = false;
+
+    if (len < NET_INPUT_HEADER_SIZE || data[0] != NET_INPUT_MAGIC_0 || data[1] != NET_INPUT_MAGIC_1 || data[2] != NET_INPUT_VERSION) {
+        dropped_packets++;
+        return;
+    }
+
+    num_events = data[3];
+    if (len < NET_INPUT_HEADER_SIZE + (num_events * 2)) {
+        dropped_packets++;
+        return;
+    }
+
+    memcpy(&seq, &data[4], sizeof(seq));
+    seq = ntohl(seq);
+
+    client = get_client(addr, addrlen, num_events > 0);
+    if (! client) {
+        dropped_packets++;
+        return;
+    }
+
+    // Duplicated or reordered packets are dropped, a sender which has been quiet for longer than the timeout may start over
+    if (client->last_seen > 0.0 && (now - client->last_seen) < NET_INPUT_TIMEOUT && (int32_t)(seq - client->seq) <= 0) {
+        dropped_packets++;
+        return;
+    }
+    client->seq = seq;
+    client->last_seen = now;
+
+    for (i = 0; i < num_events; i++) {
+        pad_nr = data[NET_INPUT_HEADER_SIZE + (i * 2) + 0];
+        op = data[NET_INPUT_HEADER_SIZE + (i * 2) + 1];
+
+        if (pad_nr >= NET_INPUT_PADS_PER_CLIENT) {
+            dropped_events++;
+            continue;
+        }
+
+        if (op == NET_OP_BYE) {
+            remove_pad(client, pad_nr);
+            continue;
+        }
+
+        if (client->pads[pad_nr] == -1)
+            reply = true;
+
+        pad = add_pad(client, pad_nr);
+        if (! pad || op == NET_OP_HELLO)
+            continue;
+
+        if ((op & ~(NET_OP_PRESS | NET_OP_KEY_MASK)) != 0 || (pad->tail - pad->head) >= NET_PAD_QUEUE_SIZE) {
+            dropped_events++;
+            continue;
+        }
+
+        pad->queue[pad->tail++ & (NET_PAD_QUEUE_SIZE - 1)] = op;
+    }
+
+    if (reply) {
+        send_reply(client, seq);
+    }
+}
+
+static void net_input_func(int fd, unsigned int events, void *arg)
+{
+    unsigned char data[NET_INPUT_PACKET_SIZE];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    ssize_t len;
+    size_t i;
+    double now;
+
+    (void)events;
+    (void)arg;
+
+    now = get_monotonic_time();
+
+    for (i = 0; i < NET_INPUT_MAX_PACKETS; i++) {
+        addrlen = sizeof(addr);
+        len = recvfrom(fd, data, sizeof(data), 0, (struct sockaddr *)&addr, &addrlen);
+        if (len < 0)
+            break;
+
+        handle_packet(data, len, &addr, addrlen, now);
+    }
+}
+
+void net_input_expire(void)
+{
+    size_t i;
+    double now;
+
+    if (net_fd == -1)
+        return;
+
+    now = get_monotonic_time();
+    if (now - last_expire < 1.0)
+        return;
+    last_expire = now;
+
+    for (i = 0; i < ARRAY_LENGTH(clients); i++) {
+        if (clients[i].used && (now - clients[i].last_seen) >= NET_INPUT_TIMEOUT) {
+            remove_client(&clients[i]);
+        }
+    }
+}
+
+bool net_input_read(struct joystick *joystick)
+{
+    struct net_pad *pad;
+    unsigned int op;
+    int key_idx;
+
+    if (joystick->net_pad < 0 || joystick->net_pad >= (int)ARRAY_LENGTH(pads))
+        return false;
+
+    pad = &pads[joystick->net_pad];
+    if (! pad->used || pad->head == pad->tail)
+        return false;
+
+    op = pad->queue[pad->head++ & (NET_PAD_QUEUE_SIZE - 1)];
+    key_idx = 1 << (op & NET_OP_KEY_MASK);
+
+    joystick->last_key_idx = key_idx;
+    joystick->last_key_val = !!(op & NET_OP_PRESS);
+    if (joystick->last_key_val) {
+        joystick->key_state |= key_idx;
+    } else {
+        joystick->key_state &= ~key_idx;
+    }
+
+    return true;
+}
+
+unsigned long net_input_dropped(void)
+{
+    return dropped_packets + dropped_events;
+}
+
+void net_input_init(int port)
+{
+    struct sockaddr_in addr = { 0 };
+    int opt;
+
+    net_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (net_fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    opt = 1;
+    (void)setsockopt(net_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(net_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (! loop_add_fd(net_fd, EPOLLIN, net_input_func, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "netinput: listening on udp port %d\n", port);
+}
@@ -362,4 +362,5 @@ const struct game pong_game = {
     tick,
     render,
     idle,
+    false,
 };
@@ -0,0 +1,179 @@
+/* remote control over MQTT */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "matelight.h"
+
+/*
+ * Commands are published below a prefix, e.g. matelight/cmd:
+ *
+ *   <prefix>/game   "tetris"              start a game
+ *   <prefix>/demo   "snake"               show a game without starting it
+ *   <prefix>/stop   ""                    stop the current game
+ *   <prefix>/key    "[player] key [press|release|tap]"
+ *
+ * Keys are up, down, left, right, select, start, a and b, player 1 and a tap
+ * (press and release) are the default. MQTT messages are only parsed and
+ * queued, the main loop runs them on its next wakeup like joypad input.
+ */
+
+#define REMOTE_QUEUE_SIZE   32
+
+static struct remote_command queue[REMOTE_QUEUE_SIZE];
+static unsigned int queue_head = 0;
+static unsigned int queue_len = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long dropped = 0;
+
+static const struct {
+    const char *name;
+    int key_idx;
+} key_names[] = {
+    { "left",   KEYPAD_LEFT },
+    { "right",  KEYPAD_RIGHT },
+    { "up",     KEYPAD_UP },
+    { "down",   KEYPAD_DOWN },
+    { "select", KEYPAD_SELECT },
+    { "start",  KEYPAD_START },
+    { "b",      KEYPAD_B },
+    { "a",      KEYPAD_A },
+};
+
+// All or nothing, so a tap never leaves a key pressed
+static bool push(const struct remote_command *cmds, unsigned int num_cmds)
+{
+    unsigned int i;
+
+    if (pthread_mutex_lock(&queue_mutex) != 0)
+        return false;
+
+    if (queue_len + num_cmds > REMOTE_QUEUE_SIZE) {
+        dropped++;
+        (void)pthread_mutex_unlock(&queue_mutex);
+        return false;
+    }
+
+    for (i = 0; i < num_cmds; i++) {
+        queue[(queue_head + queue_len) % REMOTE_QUEUE_SIZE] = cmds[i];
+        queue_len++;
+    }
+
+    (void)pthread_mutex_unlock(&queue_mutex);
+
+    loop_wakeup();
+
+    return true;
+}
+
+static bool parse_key(const char *args, struct remote_command *cmd, bool *tap)
+{
+    char words[3][16] = { { 0 } };
+    const char *key;
+    const char *action = NULL;
+    size_t i;
+    int n;
+
+    n = sscanf(args, "%15s %15s %15s", words[0], words[1], words[2]);
+    if (n < 1)
+        return false;
+
+    cmd->player = 1;
+    key = words[0];
+    if (n >= 2 && atoi(words[0]) > 0) {
+        cmd->player = atoi(words[0]);
+        key = words[1];
+        action = n >= 3 ? words[2] : NULL;
+    } else if (n >= 2) {
+        action = words[1];
+    }
+    if (cmd->player > REMOTE_MAX_PLAYERS)
+        return false;
+
+    cmd->key_idx = KEYPAD_NONE;
+    for (i = 0; i < ARRAY_LENGTH(key_names); i++) {
+        if (strcasecmp(key, key_names[i].name) == 0)
+            cmd->key_idx = key_names[i].key_idx;
+    }
+    if (cmd->key_idx == KEYPAD_NONE)
+        return false;
+
+    *tap = ! action || strcasecmp(action, "tap") == 0;
+    if (*tap || strcasecmp(action, "press") == 0) {
+        cmd->key_val = true;
+    } else if (strcasecmp(action, "release") == 0) {
+        cmd->key_val = false;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Called for MQTT messages with the topic below the prefix
+bool remote_command(const char *command, const void *payload, size_t len)
+{
+    struct remote_command cmds[2] = { { 0 }, { 0 } };
+    struct remote_command cmd = { 0 };
+    char args[64];
+    bool tap = false;
+
+    len = MIN(len, sizeof(args) - 1);
+    memcpy(args, payload, len);
+    args[len] = '\0';
+
+    if (strcmp(command, "game") == 0 || strcmp(command, "demo") == 0) {
+        cmd.type = strcmp(command, "game") == 0 ? REMOTE_GAME : REMOTE_DEMO;
+        if (sscanf(args, "%31s", cmd.game) != 1)
+            return false;
+    } else if (strcmp(command, "stop") == 0) {
+        cmd.type = REMOTE_STOP;
+    } else if (strcmp(command, "key") == 0) {
+        cmd.type = REMOTE_KEY;
+        if (! parse_key(args, &cmd, &tap)) {
+            fprintf(stderr, "remote: invalid key: %s\n", args);
+            return false;
+        }
+    } else {
+        fprintf(stderr, "remote: unknown command: %s\n", command);
+        return false;
+    }
+
+    cmds[0] = cmd;
+    if (tap) {
+        cmds[1] = cmd;
+        cmds[1].key_val = false;
+    }
+
+    return push(cmds, tap ? 2 : 1);
+}
+
+bool remote_pop(struct remote_command *cmd)
+{
+    bool ok = false;
+
+    if (pthread_mutex_lock(&queue_mutex) != 0)
+        return false;
+
+    if (queue_len > 0) {
+        *cmd = queue[queue_head];
+        queue_head = (queue_head + 1) % REMOTE_QUEUE_SIZE;
+        queue_len--;
+        ok = true;
+    }
+
+    (void)pthread_mutex_unlock(&queue_mutex);
+
+    return ok;
+}
+
+unsigned long remote_dropped(void)
+{
+    return dropped;
+}
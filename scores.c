@@ -0,0 +1,431 @@
+/* persistent high scores */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "matelight.h"
+
+/*
+ * Scores which make it into the top SCORE_TOP_N of their game are appended
+ * to a log of fixed size records. The writer thread collects them for
+ * SCORE_BATCH_SECS and writes them with one write() and fdatasync(), so the
+ * SD card sees few writes. Once the log holds more than SCORE_COMPACT_RECORDS
+ * records, was found damaged at startup or more scores came in than fit in a
+ * batch, it is replaced by the current tables through a temporary file and
+ * rename().
+ *
+ * The tables are min-heaps in memory, the weakest score at the root, filled
+ * from the log at startup. Only the main loop submits scores.
+ */
+
+#define SCORE_MAGIC             0x43534c4d  /* "MLSC" */
+#define SCORE_MAX_GAMES         16
+#define SCORE_BATCH_SECS        10
+#define SCORE_BATCH_MAX         32
+#define SCORE_COMPACT_RECORDS   256
+
+struct score_record {
+    uint32_t magic;
+    char game[16];
+    uint32_t score;
+    uint32_t time;
+    uint32_t check;
+};
+
+struct score_table {
+    char game[16];
+    unsigned int num;
+    struct score_record heap[SCORE_TOP_N];
+};
+
+static const char *score_file = NULL;
+static int log_fd = -1;
+static unsigned int log_records = 0;
+static bool needs_compact = false;
+
+static struct score_table tables[SCORE_MAX_GAMES];
+static struct score_record pending[SCORE_BATCH_MAX];
+static unsigned int pending_len = 0;
+static bool pending_overflow = false;
+static pthread_mutex_t score_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t score_cond;              // on CLOCK_MONOTONIC, set up by score_init()
+static pthread_t score_thread;
+
+// FNV-1a over everything in front of the check
+static uint32_t record_check(const struct score_record *record)
+{
+    const unsigned char *p = (const unsigned char *)record;
+    uint32_t hash = 0x811c9dc5;
+    size_t i;
+
+    for (i = 0; i < offsetof(struct score_record, check); i++) {
+        hash ^= p[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static struct score_table *get_table(const char *game, bool create)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(tables); i++) {
+        if (*tables[i].game && strcmp(tables[i].game, game) == 0)
+            return &tables[i];
+    }
+
+    if (! create)
+        return NULL;
+
+    for (i = 0; i < ARRAY_LENGTH(tables); i++) {
+        if (! *tables[i].game) {
+            strncpy(tables[i].game, game, sizeof(tables[i].game) - 1);
+            return &tables[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void heap_sift_down(struct score_table *table, unsigned int i)
+{
+    struct score_record tmp;
+    unsigned int child;
+
+    for (;;) {
+        child = (i * 2) + 1;
+        if (child >= table->num)
+            break;
+        if (child + 1 < table->num && table->heap[child + 1].score < table->heap[child].score)
+            child++;
+        if (table->heap[i].score <= table->heap[child].score)
+            break;
+        tmp = table->heap[i];
+        table->heap[i] = table->heap[child];
+        table->heap[child] = tmp;
+        i = child;
+    }
+}
+
+static void heap_sift_up(struct score_table *table, unsigned int i)
+{
+    struct score_record tmp;
+    unsigned int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (table->heap[parent].score <= table->heap[i].score)
+            break;
+        tmp = table->heap[i];
+        table->heap[i] = table->heap[parent];
+        table->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+// Returns the rank (1 is best) if the score made it into the table, 0 if not
+static int heap_insert(const struct score_record *record)
+{
+    struct score_table *table = get_table(record->game, true);
+    unsigned int i;
+    int rank = 0;
+
+    if (! table)
+        return 0;
+
+    if (table->num < SCORE_TOP_N) {
+        table->heap[table->num] = *record;
+        heap_sift_up(table, table->num++);
+    } else if (record->score > table->heap[0].score) {
+        table->heap[0] = *record;
+        heap_sift_down(table, 0);
+    } else {
+        return 0;
+    }
+
+    // Ties rank behind the older scores, the new one is counted too
+    for (i = 0; i < table->num; i++) {
+        if (table->heap[i].score >= record->score)
+            rank++;
+    }
+
+    return rank;
+}
+
+static int compare_scores(const void *a, const void *b)
+{
+    const struct score_record *ra = a;
+    const struct score_record *rb = b;
+
+    if (ra->score != rb->score)
+        return ra->score < rb->score ? 1 : -1;
+
+    return ra->time < rb->time ? -1 : ra->time > rb->time;
+}
+
+size_t score_top(const char *game, unsigned int *scores, size_t max_scores)
+{
+    struct score_record sorted[SCORE_TOP_N];
+    struct score_table *table;
+    size_t i, num = 0;
+
+    if (pthread_mutex_lock(&score_mutex) != 0)
+        return 0;
+
+    table = get_table(game, false);
+    if (table) {
+        num = table->num;
+        memcpy(sorted, table->heap, num * sizeof(sorted[0]));
+    }
+
+    (void)pthread_mutex_unlock(&score_mutex);
+
+    qsort(sorted, num, sizeof(sorted[0]), compare_scores);
+    num = MIN(num, max_scores);
+    for (i = 0; i < num; i++) {
+        scores[i] = sorted[i].score;
+    }
+
+    return num;
+}
+
+void score_submit(const char *game, unsigned int score)
+{
+    struct score_record record = { 0 };
+    char text[64];
+    int rank;
+
+    if (score == 0)
+        return;
+
+    record.magic = SCORE_MAGIC;
+    strncpy(record.game, game, sizeof(record.game) - 1);
+    record.score = score;
+    record.time = (uint32_t)time(NULL);
+    record.check = record_check(&record);
+
+    if (pthread_mutex_lock(&score_mutex) != 0)
+        return;
+
+    rank = heap_insert(&record);
+    if (rank > 0 && score_file) {
+        // The tables have it anyway, an overflow rewrites the log from them
+        if (pending_len < ARRAY_LENGTH(pending)) {
+            pending[pending_len++] = record;
+        } else {
+            pending_overflow = true;
+        }
+        (void)pthread_cond_signal(&score_cond);
+    }
+
+    (void)pthread_mutex_unlock(&score_mutex);
+
+    if (rank == 0)
+        return;
+
+    fprintf(stderr, "scores: %s: %u, rank %d\n", game, score, rank);
+    mqtt_publish_score(game, score, rank);
+    if (rank == 1) {
+        snprintf(text, sizeof(text), "HIGH SCORE %u", score);
+        do_announce(text, COLOR_YELLOW, COLOR_BLACK, 10.0);
+    }
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static int open_log(void)
+{
+    int fd = open(score_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        perror(score_file);
+
+    return fd;
+}
+
+// Writer thread only, replaces the log with the current tables
+static void compact(void)
+{
+    struct score_record records[SCORE_MAX_GAMES * SCORE_TOP_N];
+    char tmp_file[PATH_MAX];
+    unsigned int num = 0;
+    size_t i;
+    int fd;
+    bool ok;
+
+    // Pending records are in the tables already
+    if (pthread_mutex_lock(&score_mutex) != 0)
+        return;
+    for (i = 0; i < ARRAY_LENGTH(tables); i++) {
+        memcpy(&records[num], tables[i].heap, tables[i].num * sizeof(records[0]));
+        num += tables[i].num;
+    }
+    pending_len = 0;
+    pending_overflow = false;
+    (void)pthread_mutex_unlock(&score_mutex);
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", score_file);
+    fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(tmp_file);
+        return;
+    }
+
+    ok = write_all(fd, records, num * sizeof(records[0])) && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (! ok || rename(tmp_file, score_file) != 0) {
+        perror(score_file);
+        (void)unlink(tmp_file);
+        return;
+    }
+
+    // The old descriptor still points to the replaced file
+    if (log_fd != -1)
+        close(log_fd);
+    log_fd = open_log();
+    log_records = num;
+    needs_compact = false;
+
+    fprintf(stderr, "scores: compacted %s to %u records\n", score_file, num);
+}
+
+static void *score_thread_func(void *arg)
+{
+    struct score_record batch[SCORE_BATCH_MAX];
+    struct timespec deadline;
+    unsigned int num;
+
+    (void)arg;
+
+    if (needs_compact)
+        compact();
+
+    for (;;) {
+        if (pthread_mutex_lock(&score_mutex) != 0)
+            return NULL;
+
+        while (pending_len == 0)
+            (void)pthread_cond_wait(&score_cond, &score_mutex);
+
+        // Collect what comes in shortly after, one write for all of it
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += SCORE_BATCH_SECS;
+        while (pending_len > 0 && pending_len < ARRAY_LENGTH(pending)) {
+            if (pthread_cond_timedwait(&score_cond, &score_mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        num = pending_len;
+        memcpy(batch, pending, num * sizeof(batch[0]));
+        pending_len = 0;
+        if (pending_overflow)
+            needs_compact = true;
+
+        (void)pthread_mutex_unlock(&score_mutex);
+
+        if (needs_compact) {
+            compact();
+            continue;
+        }
+
+        if (log_fd == -1 || ! write_all(log_fd, batch, num * sizeof(batch[0])) || fdatasync(log_fd) != 0) {
+            perror(score_file);
+            needs_compact = true;
+        } else {
+            log_records += num;
+        }
+
+        if (needs_compact || log_records > SCORE_COMPACT_RECORDS)
+            compact();
+    }
+
+    return NULL;
+}
+
+static void load(void)
+{
+    struct score_record record;
+    ssize_t len;
+    int fd;
+
+    fd = open(score_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            perror(score_file);
+        return;
+    }
+
+    for (;;) {
+        len = read(fd, &record, sizeof(record));
+        if (len == 0)
+            break;
+        // A torn or damaged record would misalign everything appended after it
+        if (len != sizeof(record) || record.magic != SCORE_MAGIC || record.check != record_check(&record)) {
+            needs_compact = true;
+            if (len != sizeof(record))
+                break;
+            continue;
+        }
+        record.game[sizeof(record.game) - 1] = '\0';
+        (void)heap_insert(&record);
+        log_records++;
+    }
+
+    close(fd);
+
+    fprintf(stderr, "scores: loaded %u records from %s\n", log_records, score_file);
+}
+
+void score_init(const char *path)
+{
+    pthread_condattr_t attr;
+
+    if (! path || ! *path)
+        return;
+
+    // Deadlines must not move with the wall clock
+    if (pthread_condattr_init(&attr) != 0 || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&score_cond, &attr) != 0) {
+        fprintf(stderr, "scores: %s: not saving scores\n", path);
+        return;
+    }
+    (void)pthread_condattr_destroy(&attr);
+
+    score_file = path;
+    load();
+
+    log_fd = open_log();
+    if (log_fd == -1 || pthread_create(&score_thread, NULL, score_thread_func, NULL) != 0) {
+        fprintf(stderr, "scores: %s: not saving scores\n", score_file);
+        score_file = NULL;
+        return;
+    }
+
+    (void)pthread_detach(score_thread);
+}
@@ -0,0 +1,220 @@
+/* shared memory framebuffer for local producers */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "matelight.h"
+#include "contrib/matelight_fb.h"
+
+/*
+ * The layout and the client side live in contrib/matelight_fb.h. The frame
+ * is read straight from the mapping into the output frame, a read which
+ * raced with the producer is thrown away and the next frame is waited for.
+ */
+
+#if MATELIGHT_FB_MAX_PIXELS < MAX_GRID_WIDTH * MAX_GRID_HEIGHT
+#error "MATELIGHT_FB_MAX_PIXELS too small for the largest grid"
+#endif
+
+static struct matelight_fb *fb = NULL;
+static int event_fd = -1;
+static int listen_fd = -1;
+static uint32_t last_seq = 0;
+static double last_frame = 0.0;
+static bool showing = false;
+
+static unsigned long torn_frames = 0;
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static void check_seq(void)
+{
+    uint32_t seq = __atomic_load_n(&fb->seq, __ATOMIC_ACQUIRE);
+
+    if (seq != last_seq && ! (seq & 1)) {
+        last_seq = seq;
+        last_frame = get_monotonic_time();
+    }
+}
+
+static void event_func(int fd, unsigned int events, void *arg)
+{
+    uint64_t val;
+
+    (void)events;
+    (void)arg;
+
+    (void)read(fd, &val, sizeof(val));
+    check_seq();
+}
+
+static void accept_func(int fd, unsigned int events, void *arg)
+{
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    char byte = 0;
+    struct iovec iov = { &byte, sizeof(byte) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    int client_fd;
+
+    (void)events;
+    (void)arg;
+
+    client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd == -1)
+        return;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &event_fd, sizeof(int));
+
+    if (sendmsg(client_fd, &msg, MSG_NOSIGNAL) == -1)
+        perror("framebuffer: sendmsg");
+    close(client_fd);
+}
+
+static void render(bool *display, char *screen)
+{
+    size_t size = grid_width * grid_height * 3;
+    uint32_t seq;
+
+    *display = false;
+    if (! fb)
+        return;
+
+    seq = __atomic_load_n(&fb->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return;
+
+    memcpy(screen, fb->pixels, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&fb->seq, __ATOMIC_RELAXED) != seq) {
+        torn_frames++;
+        return;
+    }
+
+    *display = true;
+}
+
+static bool idle(void)
+{
+    bool active;
+
+    if (! fb)
+        return true;
+
+    fb->width = grid_width;
+    fb->height = grid_height;
+
+    // Producers without the eventfd are only noticed here
+    check_seq();
+
+    active = last_frame > 0.0 && (get_monotonic_time() - last_frame) < (MATELIGHT_FB_TIMEOUT_MS / 1000.0);
+    if (active != showing) {
+        showing = active;
+        fprintf(stderr, "framebuffer: producer %s (%lu torn frames)\n", active ? "started" : "stopped", torn_frames);
+    }
+
+    return ! active;
+}
+
+void shm_fb_init(const char *path)
+{
+    struct sockaddr_un addr = { 0 };
+    int fd;
+
+    if (strlen(path) + sizeof(".sock") > sizeof(addr.sun_path)) {
+        fprintf(stderr, "framebuffer: path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1 || ftruncate(fd, sizeof(*fb)) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    fb = mmap(NULL, sizeof(*fb), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (fb == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    // A producer which died in the middle of a frame must not block the next one
+    fb->magic = MATELIGHT_FB_MAGIC;
+    fb->version = MATELIGHT_FB_VERSION;
+    fb->width = grid_width;
+    fb->height = grid_height;
+    fb->seq = 0;
+    last_seq = 0;
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    if (! loop_add_fd(event_fd, EPOLLIN, event_func, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.sock", path);
+    (void)unlink(addr.sun_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 4) != 0) {
+        perror(addr.sun_path);
+        exit(EXIT_FAILURE);
+    }
+    if (! loop_add_fd(listen_fd, EPOLLIN, accept_func, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "framebuffer: %s (%dx%d)\n", path, grid_width, grid_height);
+}
+
+const struct game framebuffer_game = {
+    "framebuffer",
+    false,
+    false,
+    0.1,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    render,
+    idle,
+    true,
+};
@@ -237,6 +237,7 @@ static void move_snake(void)
         case OBJ_SNAKEHEAD:
         case OBJ_POISON:
             game_mode = MODE_DEAD;
+            score_submit(snake_game.name, snakelen);
             break;
         case OBJ_FOOD:
         case OBJ_SUPERFOOD:
@@ -472,4 +473,5 @@ const struct game snake_game = {
     tick,
     render,
     idle,
+    false,
 };
@@ -0,0 +1,207 @@
+/* telemetry published over MQTT */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "matelight.h"
+
+/*
+ * The frame loop only bumps its own counters and histogram buckets here, the
+ * other modules keep theirs (mqtt_get_stats(), mdns_get_stats()). Everything
+ * is collected and formatted by a timer in the main loop once per interval.
+ *
+ * Durations go into log-linear histograms in microseconds: exact below 8 us,
+ * above that 8 buckets per power of two, so percentiles are within 12.5%.
+ */
+
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    200     /* up to about a minute */
+
+struct histogram {
+    unsigned long count;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+static const char *telemetry_topic = NULL;
+static int timer_fd = -1;
+static uint64_t last_publish = 0;
+static uint64_t start_clock = 0;
+
+// Main loop counters
+static unsigned long frames_rendered = 0;
+static unsigned long frames_sent = 0;
+static unsigned long bytes_sent = 0;
+static unsigned long last_bytes_sent = 0;
+static struct histogram tick_hist;
+static struct histogram render_hist;
+static const char *shown_game = "";
+static const char *selected_game = "";
+static char controller[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)] = { 0 };
+
+uint64_t telemetry_clock(void)
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+static void hist_add(struct histogram *hist, uint64_t us)
+{
+    unsigned int exp;
+    unsigned int idx;
+
+    if (us < HIST_SUB) {
+        idx = us;
+    } else {
+        exp = 63 - __builtin_clzll(us);
+        idx = ((exp - HIST_SUB_BITS + 1) * HIST_SUB) + ((us >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    }
+
+    hist->buckets[MIN(idx, HIST_BUCKETS - 1)]++;
+    hist->count++;
+}
+
+// Lower bound of the bucket holding the given fraction of the samples
+static unsigned long hist_percentile(const struct histogram *hist, double fraction)
+{
+    unsigned long want = (unsigned long)((hist->count * fraction) + 0.999999);
+    unsigned long sum = 0;
+    unsigned int idx, exp;
+
+    if (hist->count == 0)
+        return 0;
+
+    for (idx = 0; idx < HIST_BUCKETS - 1; idx++) {
+        sum += hist->buckets[idx];
+        if (sum >= MAX(want, 1))
+            break;
+    }
+
+    if (idx < HIST_SUB)
+        return idx;
+
+    exp = (idx / HIST_SUB) + HIST_SUB_BITS - 1;
+    return (unsigned long)(HIST_SUB + (idx % HIST_SUB)) << (exp - HIST_SUB_BITS);
+}
+
+void telemetry_tick(uint64_t us)
+{
+    hist_add(&tick_hist, us);
+}
+
+void telemetry_render(uint64_t us, bool display)
+{
+    hist_add(&render_hist, us);
+    if (display)
+        frames_rendered++;
+}
+
+void telemetry_frame_sent(size_t bytes)
+{
+    frames_sent++;
+    bytes_sent += bytes;
+}
+
+void telemetry_set_games(const char *shown, const char *selected)
+{
+    shown_game = shown;
+    selected_game = selected;
+}
+
+void telemetry_set_controller(const char *address)
+{
+    strncpy(controller, address, sizeof(controller) - 1);
+}
+
+static void publish(void)
+{
+    char payload[768];
+    struct wled_stats wled_stats = { 0 };
+    struct input_stats input_stats;
+    struct mqtt_stats mqtt_stats;
+    uint64_t now = telemetry_clock();
+    double elapsed = (now - last_publish) / 1000000.0;
+    int len;
+
+    if (wled_ds)
+        mdns_get_stats(&wled_stats);
+    input_get_stats(&input_stats);
+    mqtt_get_stats(&mqtt_stats);
+
+    len = snprintf(payload, sizeof(payload),
+                   "{\"uptime\":%lu,\"frames\":{\"rendered\":%lu,\"sent\":%lu},"
+                   "\"tick_us\":{\"n\":%lu,\"p50\":%lu,\"p99\":%lu},"
+                   "\"render_us\":{\"n\":%lu,\"p50\":%lu,\"p99\":%lu},"
+                   "\"bytes_per_s\":%.0f,\"game\":\"%s\",\"selected\":\"%s\","
+                   "\"joysticks\":%d,\"players\":%d,\"controller\":\"%s\","
+                   "\"discovery\":{\"mdns\":%s,\"active\":%s,\"candidates\":%u,\"switches\":%lu,\"failures\":%lu},"
+                   "\"dropped\":{\"input\":%lu,\"ingest\":%lu,\"announce\":%lu,\"animation\":%lu,\"remote\":%lu},"
+                   "\"mqtt\":{\"received\":%lu,\"announced\":%lu,\"rejected\":%lu,\"duplicates\":%lu,\"rate_limited\":%lu,\"reconnects\":%lu}}",
+                   (unsigned long)((now - start_clock) / 1000000), frames_rendered, frames_sent,
+                   tick_hist.count, hist_percentile(&tick_hist, 0.5), hist_percentile(&tick_hist, 0.99),
+                   render_hist.count, hist_percentile(&render_hist, 0.5), hist_percentile(&render_hist, 0.99),
+                   elapsed > 0.0 ? (bytes_sent - last_bytes_sent) / elapsed : 0.0, shown_game, selected_game,
+                   count_joysticks(), count_players(), controller,
+                   wled_ds ? "true" : "false", (wled_ds ? wled_stats.active : *controller) ? "true" : "false",
+                   wled_stats.candidates, wled_stats.switches, wled_stats.failures,
+                   input_stats.dropped, frame_ingest_dropped(), announce_dropped(), animation_rejected(), remote_dropped(),
+                   mqtt_stats.received, mqtt_stats.announced, mqtt_stats.rejected,
+                   mqtt_stats.duplicates, mqtt_stats.rate_limited, mqtt_stats.reconnects);
+    if (len < 0 || (size_t)len >= sizeof(payload))
+        return;
+
+    // Percentiles cover one interval, counters the whole run
+    memset(&tick_hist, '\0', sizeof(tick_hist));
+    memset(&render_hist, '\0', sizeof(render_hist));
+    last_bytes_sent = bytes_sent;
+    last_publish = now;
+
+    (void)mqtt_publish(telemetry_topic, payload, len, false);
+}
+
+static void timer_func(int fd, unsigned int events, void *arg)
+{
+    uint64_t expirations;
+
+    (void)events;
+    (void)arg;
+
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        publish();
+}
+
+void telemetry_init(const char *topic, int interval)
+{
+    struct itimerspec its = { { 0 }, { 0 } };
+
+    start_clock = last_publish = telemetry_clock();
+
+    if (! topic || interval <= 0)
+        return;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        perror("timerfd_create");
+        return;
+    }
+
+    its.it_interval.tv_sec = interval;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(timer_fd, 0, &its, NULL) != 0 || ! loop_add_fd(timer_fd, EPOLLIN, timer_func, NULL)) {
+        close(timer_fd);
+        timer_fd = -1;
+        return;
+    }
+
+    telemetry_topic = topic;
+    fprintf(stderr, "telemetry: %s every %d seconds\n", topic, interval);
+}
@@ -562,8 +562,10 @@ static void tick(void)
 {
     if (game_mode != MODE_GAME) return;
 
-    if (! doit())
+    if (! doit()) {
         game_mode = MODE_DEAD;
+        score_submit(tetris_game.name, tetris->score);
+    }
 }
 
 static void input(int player, int key_idx, bool key_val, int key_state)
@@ -641,4 +643,5 @@ const struct game tetris_game = {
     tick,
     render,
     idle,
+    false,
 };
@@ -0,0 +1,291 @@
+/* MQTT topic table and wildcard matching */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matelight.h"
+
+/*
+ * The topic file has one subscription per line, empty lines and lines
+ * starting with '#' are ignored:
+ *
+ *   <filter> <fg RRGGBB> <bg RRGGBB> <speed> <low|normal|high> <normal|bold> [<ttl seconds>]
+ *
+ * Filters may use the MQTT wildcards '+' (one level) and '#' (the rest). The
+ * filters are compiled into a trie with one node per topic level, a message
+ * topic is matched level by level. Exact levels win over '+', '+' over '#'.
+ * The table is built before the MQTT client starts and only read afterwards.
+ */
+
+#define TOPIC_MAX_NODES     128
+#define TOPIC_MAX_LEVEL     48
+
+struct topic_node {
+    char level[TOPIC_MAX_LEVEL];
+    int child;
+    int sibling;
+    int topic;
+};
+
+static struct mqtt_topic topics[MQTT_MAX_TOPICS];
+static size_t num_topics = 0;
+static struct topic_node nodes[TOPIC_MAX_NODES];
+static int num_nodes = 0;
+
+static const struct mqtt_topic default_topic = {
+    "hackeriet/ding", COLOR_BLACK, COLOR_YELLOW, 5.0, ANNOUNCE_FONT_NORMAL, ANNOUNCE_PRIO_HIGH, 60.0,
+};
+
+static int new_node(const char *level, size_t len)
+{
+    struct topic_node *node;
+
+    if (num_nodes >= TOPIC_MAX_NODES || len >= TOPIC_MAX_LEVEL)
+        return -1;
+
+    node = &nodes[num_nodes];
+    memcpy(node->level, level, len);
+    node->level[len] = '\0';
+    node->child = -1;
+    node->sibling = -1;
+    node->topic = -1;
+
+    return num_nodes++;
+}
+
+static int find_child(int parent, const char *level, size_t len)
+{
+    int child;
+
+    for (child = nodes[parent].child; child != -1; child = nodes[child].sibling) {
+        if (strncmp(nodes[child].level, level, len) == 0 && nodes[child].level[len] == '\0')
+            return child;
+    }
+
+    return -1;
+}
+
+// Wildcards take a whole level, '#' only the last one
+static bool valid_filter(const char *filter)
+{
+    const char *level = filter;
+    const char *end;
+    size_t len;
+
+    for (;;) {
+        end = strchr(level, '/');
+        len = end ? (size_t)(end - level) : strlen(level);
+
+        if (len >= TOPIC_MAX_LEVEL)
+            return false;
+        if ((memchr(level, '+', len) && len != 1) || (memchr(level, '#', len) && (len != 1 || end)))
+            return false;
+
+        if (! end)
+            return true;
+        level = end + 1;
+    }
+}
+
+// Only fails when the trie is full, the filter was checked by valid_filter()
+static bool add_filter(const char *filter, int topic)
+{
+    const char *level = filter;
+    const char *end;
+    size_t len;
+    int node = 0;
+    int child;
+
+    for (;;) {
+        end = strchr(level, '/');
+        len = end ? (size_t)(end - level) : strlen(level);
+
+        child = find_child(node, level, len);
+        if (child == -1) {
+            child = new_node(level, len);
+            if (child == -1)
+                return false;
+            nodes[child].sibling = nodes[node].child;
+            nodes[node].child = child;
+        }
+        node = child;
+
+        if (! end)
+            break;
+        level = end + 1;
+    }
+
+    if (nodes[node].topic == -1)
+        nodes[node].topic = topic;
+
+    return true;
+}
+
+static void build_trie(void)
+{
+    size_t i;
+
+    num_nodes = 0;
+    (void)new_node("", 0);
+
+    for (i = 0; i < num_topics; i++) {
+        (void)add_filter(topics[i].filter, i);
+    }
+}
+
+// topic is the rest of the message topic after node, NULL if all levels matched
+static int match_node(int node, const char *topic)
+{
+    const char *end;
+    const char *next;
+    size_t len;
+    int child;
+    int result;
+
+    if (! topic) {
+        if (nodes[node].topic != -1)
+            return nodes[node].topic;
+        // "a/#" matches "a" too
+        child = find_child(node, "#", 1);
+        return child != -1 ? nodes[child].topic : -1;
+    }
+
+    end = strchr(topic, '/');
+    len = end ? (size_t)(end - topic) : strlen(topic);
+    next = end ? end + 1 : NULL;
+
+    child = find_child(node, topic, len);
+    if (child != -1) {
+        result = match_node(child, next);
+        if (result != -1)
+            return result;
+    }
+
+    // Wildcards at the top do not match topics like $SYS
+    if (node == 0 && topic[0] == '$')
+        return -1;
+
+    child = find_child(node, "+", 1);
+    if (child != -1) {
+        result = match_node(child, next);
+        if (result != -1)
+            return result;
+    }
+
+    child = find_child(node, "#", 1);
+    return child != -1 ? nodes[child].topic : -1;
+}
+
+const struct mqtt_topic *mqtt_topic_match(const char *topic)
+{
+    int result;
+
+    if (! topic || num_nodes == 0)
+        return NULL;
+
+    result = match_node(0, topic);
+
+    return result != -1 ? &topics[result] : NULL;
+}
+
+const struct mqtt_topic *mqtt_topic_get(size_t index)
+{
+    return index < num_topics ? &topics[index] : NULL;
+}
+
+int mqtt_parse_priority(const char *str)
+{
+    if (strcmp(str, "low") == 0)
+        return ANNOUNCE_PRIO_LOW;
+    if (strcmp(str, "normal") == 0)
+        return ANNOUNCE_PRIO_NORMAL;
+    if (strcmp(str, "high") == 0)
+        return ANNOUNCE_PRIO_HIGH;
+    return -1;
+}
+
+int mqtt_parse_font(const char *str)
+{
+    if (strcmp(str, "normal") == 0)
+        return ANNOUNCE_FONT_NORMAL;
+    if (strcmp(str, "bold") == 0)
+        return ANNOUNCE_FONT_BOLD;
+    return -1;
+}
+
+static bool parse_line(const char *line, struct mqtt_topic *topic)
+{
+    char priority[16];
+    char font[16];
+    int n;
+
+    memset(topic, '\0', sizeof(*topic));
+    topic->ttl = ANNOUNCE_TTL;
+
+    n = sscanf(line, "%127s %x %x %lf %15s %15s %lf", topic->filter, &topic->color, &topic->bgcolor, &topic->speed, priority, font, &topic->ttl);
+    // Written this way round so nan is rejected too
+    if (n < 6 || topic->color > 0xffffff || topic->bgcolor > 0xffffff || ! (topic->speed > 0.0) || ! (topic->ttl > 0.0))
+        return false;
+    if (! valid_filter(topic->filter))
+        return false;
+
+    topic->priority = mqtt_parse_priority(priority);
+    topic->font = mqtt_parse_font(font);
+
+    return topic->priority != -1 && topic->font != -1;
+}
+
+void mqtt_topics_load(const char *path)
+{
+    FILE *fp = NULL;
+    char line[256];
+    char *s;
+    int line_nr = 0;
+
+    num_topics = 0;
+    build_trie();
+
+    if (path && *path) {
+        fp = fopen(path, "r");
+        if (! fp)
+            perror(path);
+    }
+
+    while (fp && fgets(line, sizeof(line), fp)) {
+        line_nr++;
+        for (s = line; *s == ' ' || *s == '\t'; s++)
+            ;
+        if (*s == '#' || *s == '\n' || *s == '\r' || *s == '\0')
+            continue;
+
+        if (num_topics >= MQTT_MAX_TOPICS) {
+            fprintf(stderr, "mqtt: %s:%d: too many topics\n", path, line_nr);
+            break;
+        }
+        if (! parse_line(s, &topics[num_topics])) {
+            fprintf(stderr, "mqtt: %s:%d: invalid topic line\n", path, line_nr);
+            continue;
+        }
+        // The trie is rebuilt from the lines before so no nodes of this one are left
+        if (! add_filter(topics[num_topics].filter, num_topics)) {
+            fprintf(stderr, "mqtt: %s:%d: no room for topic filter\n", path, line_nr);
+            build_trie();
+            continue;
+        }
+        num_topics++;
+    }
+
+    if (fp)
+        fclose(fp);
+
+    if (num_topics == 0) {
+        topics[0] = default_topic;
+        num_topics = 1;
+        build_trie();
+    }
+
+    fprintf(stderr, "mqtt: %zu topics, %d trie nodes\n", num_topics, num_nodes);
+}
@@ -1,109 +1,684 @@
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 
 #include "matelight.h"
 
 
 #include <curl/curl.h>
 
-struct MemoryStruct {
-    char *memory;
-    size_t size;
+#define WLED_PROBE_CONNECT_TIMEOUT_MS   1000L
+#define WLED_PROBE_TIMEOUT_MS           3000L
+#define WLED_PING_CONNECT_TIMEOUT_MS    500L
+#define WLED_PING_TIMEOUT_MS            1000L
+#define WLED_STATE_CONNECT_TIMEOUT_MS   500L
+#define WLED_STATE_TIMEOUT_MS           2000L
+
+#define WLED_POOL_SIZE                  WLED_PROBE_MAX
+
+/*
+ * Easy handles and the multi handle live as long as the program. The multi
+ * handle owns the connection cache, so a controller which is asked again
+ * (health pings every few seconds) is served on the already open connection.
+ * One transfer round at a time, the mutex is held while it runs.
+ */
+struct wled_pool {
+    pthread_mutex_t mutex;
+    CURLM *multi_handle;
+    CURL *curl_handles[WLED_POOL_SIZE];
+    bool busy[WLED_POOL_SIZE];
+};
+
+struct info_request {
+    struct json_parser parser;
+    struct wled_info info;
+};
+
+// Called for every finished transfer, returns true to cancel the remaining ones
+typedef bool (*wled_done_func)(size_t idx, CURL *curl, CURLcode res, void *arg);
+
+struct probe_round {
+    const char * const *addrs;
+    struct info_request *reqs;
+    int winner;
 };
 
-static size_t write_memory_callback(void *contents, size_t size, size_t nmemb, void *userp)
+struct ping_round {
+    const char * const *addrs;
+    bool *ok;
+    double *rtt_ms;
+    struct timespec start;
+    size_t num_ok;
+};
+
+/*
+ * Rounds started from the main loop run on their own pool. Instead of
+ * waiting in curl_multi_poll() the loop watches the sockets and the timer
+ * curl asks for and drives the transfers, the result is reported from there
+ * once all of them are done or the done function cancelled the rest. One
+ * round at a time, the addresses must stay valid until it is reported.
+ */
+struct loop_round {
+    bool running;
+    CURL *curl_handles[WLED_PROBE_MAX];
+    size_t num_handles;
+    size_t num_active;
+    size_t num_done;
+    wled_done_func done_func;
+    void *done_arg;
+    void (*finish_func)(void);
+    struct timespec start;
+    struct info_request reqs[WLED_PROBE_MAX];
+    bool ok[WLED_PROBE_MAX];
+    double rtt_ms[WLED_PROBE_MAX];
+    struct probe_round probe;
+    struct ping_round ping;
+    wled_probe_func probe_func;
+    wled_ping_func ping_func;
+    void *arg;
+};
+
+// State pushes get their own pool, they must not wait behind a probe round
+static struct wled_pool pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static struct wled_pool state_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static struct wled_pool loop_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static struct loop_round loop_round;
+static int loop_timer_fd = -1;
+static struct curl_slist *json_headers = NULL;
+static bool curl_initialized = false;
+
+static void info_value(const char *path, int type, const char *value, size_t len, void *arg)
+{
+    struct wled_info *info = arg;
+
+    if (type == JSON_TYPE_STRING) {
+        if (strcmp(path, "name") == 0) {
+            snprintf(info->name, sizeof(info->name), "%.*s", (int)len, value);
+        } else if (strcmp(path, "ver") == 0) {
+            snprintf(info->version, sizeof(info->version), "%.*s", (int)len, value);
+        }
+    } else if (type == JSON_TYPE_NUMBER) {
+        if (strcmp(path, "leds.count") == 0) {
+            info->leds = atoi(value);
+        } else if (strcmp(path, "leds.matrix.w") == 0) {
+            info->matrix_width = atoi(value);
+        } else if (strcmp(path, "leds.matrix.h") == 0) {
+            info->matrix_height = atoi(value);
+        } else if (strcmp(path, "udpport") == 0) {
+            info->udp_port = atoi(value);
+        }
+    }
+}
+
+// The body is parsed as it comes in, nothing of it is kept around
+static size_t info_callback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    struct info_request *req = userp;
+
+    if (! json_feed(&req->parser, contents, size * nmemb))
+        return 0;
+
+    return size * nmemb;
+}
+
+static void info_request_init(struct info_request *req)
 {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-    char *ptr;
+    memset(&req->info, '\0', sizeof(req->info));
+    json_init(&req->parser, info_value, &req->info);
+}
+
+static size_t discard_callback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    (void)contents;
+    (void)userp;
+
+    return size * nmemb;
+}
 
-    if (! mem->memory) {
-        ptr = malloc(realsize + 1);
+static bool pool_lock(struct wled_pool *p)
+{
+    if (pthread_mutex_lock(&p->mutex) != 0)
+        return false;
+
+    if (! p->multi_handle) {
+        p->multi_handle = curl_multi_init();
+        if (! p->multi_handle) {
+            (void)pthread_mutex_unlock(&p->mutex);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void pool_unlock(struct wled_pool *p)
+{
+    (void)pthread_mutex_unlock(&p->mutex);
+}
+
+static CURL *wled_api_request(struct wled_pool *p, const char *addr, const char *path, struct info_request *req, long connect_timeout_ms, long timeout_ms)
+{
+    char url[7 + MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 16 + 1];
+    CURL *curl;
+    size_t i;
+
+    for (i = 0; i < ARRAY_LENGTH(p->curl_handles); i++) {
+        if (! p->busy[i])
+            break;
+    }
+    if (i == ARRAY_LENGTH(p->curl_handles))
+        return NULL;
+
+    if (! p->curl_handles[i]) {
+        p->curl_handles[i] = curl_easy_init();
+        if (! p->curl_handles[i])
+            return NULL;
+    }
+    curl = p->curl_handles[i];
+
+    // Forget the options of the last transfer, connections and DNS cache stay
+    curl_easy_reset(curl);
+
+    snprintf(url, sizeof(url), "http://%s%s", addr, path);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    if (req) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, info_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)req);
     } else {
-        ptr = realloc(mem->memory, mem->size + realsize + 1);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
     }
-    if (! ptr) {
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
+    curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)(1024L*1024L));
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    if (curl_multi_add_handle(p->multi_handle, curl) != CURLM_OK)
+        return NULL;
+    p->busy[i] = true;
+
+    return curl;
+}
+
+// Hands finished transfers to done_func, returns true once it cancelled the rest
+static bool read_messages(struct wled_pool *p, CURL * const *curl_handles, size_t num_handles, wled_done_func done_func, void *arg, size_t *num_done)
+{
+    CURLMsg *msg;
+    size_t i;
+    int msgs_left;
+
+    while ((msg = curl_multi_info_read(p->multi_handle, &msgs_left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        for (i = 0; i < num_handles; i++) {
+            if (curl_handles[i] && curl_handles[i] == msg->easy_handle)
+                break;
+        }
+        if (i == num_handles)
+            continue;
+
+        (*num_done)++;
+        if (done_func(i, curl_handles[i], msg->data.result, arg))
+            return true;
+    }
+
+    return false;
+}
+
+// Removing a handle cancels its transfer
+static void remove_handles(struct wled_pool *p, CURL * const *curl_handles, size_t num_handles)
+{
+    size_t i;
+
+    for (i = 0; i < num_handles; i++) {
+        if (curl_handles[i])
+            curl_multi_remove_handle(p->multi_handle, curl_handles[i]);
+    }
+    memset(p->busy, '\0', sizeof(p->busy));
+}
+
+// Runs all added transfers to completion
+static void wled_api_run(struct wled_pool *p, CURL * const *curl_handles, size_t num_handles, wled_done_func done_func, void *arg)
+{
+    size_t num_done = 0;
+    int running = 0;
+
+    do {
+        if (curl_multi_perform(p->multi_handle, &running) != CURLM_OK)
+            break;
+
+        if (read_messages(p, curl_handles, num_handles, done_func, arg, &num_done) || running == 0)
+            break;
+
+        if (curl_multi_poll(p->multi_handle, NULL, 0, 100, NULL) != CURLM_OK)
+            break;
+    } while (running > 0);
+
+    remove_handles(p, curl_handles, num_handles);
+}
+
+static void loop_round_check(void)
+{
+    struct loop_round *r = &loop_round;
+    bool stop;
+
+    if (! r->running)
+        return;
+
+    stop = read_messages(&loop_pool, r->curl_handles, r->num_handles, r->done_func, r->done_arg, &r->num_done);
+    if (! stop && r->num_done < r->num_active)
+        return;
+
+    remove_handles(&loop_pool, r->curl_handles, r->num_handles);
+    r->running = false;
+    r->finish_func();
+}
+
+static void loop_socket_func(int fd, unsigned int events, void *arg)
+{
+    int action = 0;
+    int running;
+
+    (void)arg;
+
+    if (events & EPOLLIN)
+        action |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT)
+        action |= CURL_CSELECT_OUT;
+    if (events & (EPOLLERR | EPOLLHUP))
+        action |= CURL_CSELECT_ERR;
+
+    (void)curl_multi_socket_action(loop_pool.multi_handle, fd, action, &running);
+    loop_round_check();
+}
+
+static void loop_timer_func(int fd, unsigned int events, void *arg)
+{
+    int running;
+
+    (void)fd;
+    (void)events;
+    (void)arg;
+
+    (void)curl_multi_socket_action(loop_pool.multi_handle, CURL_SOCKET_TIMEOUT, 0, &running);
+    loop_round_check();
+}
+
+// Which sockets curl wants watched, socketp tells whether the loop has it already
+static int socket_callback(CURL *curl, curl_socket_t s, int what, void *userp, void *socketp)
+{
+    unsigned int events = 0;
+
+    (void)curl;
+    (void)userp;
+
+    if (what == CURL_POLL_REMOVE) {
+        loop_del_fd(s);
         return 0;
     }
 
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
+    if (what & CURL_POLL_IN)
+        events |= EPOLLIN;
+    if (what & CURL_POLL_OUT)
+        events |= EPOLLOUT;
+
+    if (socketp) {
+        loop_mod_fd(s, events);
+    } else if (loop_add_fd(s, events, loop_socket_func, NULL)) {
+        (void)curl_multi_assign(loop_pool.multi_handle, s, &loop_pool);
+    }
 
-    return realsize;
+    return 0;
 }
 
-void wled_api_init(void)
+static int timer_callback(CURLM *multi_handle, long timeout_ms, void *userp)
 {
-    curl_global_init(CURL_GLOBAL_ALL);
-    //curl_global_cleanup();
+    (void)multi_handle;
+    (void)userp;
+
+    loop_set_timer(loop_timer_fd, timeout_ms);
+
+    return 0;
 }
 
-bool wled_xml_check(struct MemoryStruct *chunk)
+// Only used from the main loop, the mutex is not needed
+static bool loop_pool_init(void)
 {
-    char *s = chunk->memory;
-    /* XML parsing for dummies */
+    if (loop_pool.multi_handle)
+        return true;
 
-    if (strncmp(s, "<?xml", 5))
+    loop_timer_fd = loop_add_timer(loop_timer_func, NULL);
+    if (loop_timer_fd == -1)
         return false;
 
-    s = strstr(s, "<ds>");
-    if (! s)
+    loop_pool.multi_handle = curl_multi_init();
+    if (! loop_pool.multi_handle) {
+        loop_del_timer(loop_timer_fd);
+        loop_timer_fd = -1;
         return false;
-    s += 4;
+    }
+
+    curl_multi_setopt(loop_pool.multi_handle, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(loop_pool.multi_handle, CURLMOPT_TIMERFUNCTION, timer_callback);
+
+    return true;
+}
+
+// Adding the handles makes curl ask for its timer, the transfers start from there
+static bool loop_round_start(const char * const *addrs, size_t num_addrs, bool info, long connect_timeout_ms, long timeout_ms, wled_done_func done_func, void *done_arg, void (*finish_func)(void))
+{
+    struct loop_round *r = &loop_round;
+    size_t i;
 
-    if (strncmp(s, wled_ds, strlen(wled_ds)) != 0)
+    if (r->running || num_addrs == 0 || ! loop_pool_init())
         return false;
-    s += strlen(wled_ds);
 
-    if (strncmp(s, " (live)", 7) == 0)
-        s += 7;
+    num_addrs = MIN(num_addrs, WLED_PROBE_MAX);
+    r->num_handles = num_addrs;
+    r->num_active = 0;
+    r->num_done = 0;
+    for (i = 0; i < num_addrs; i++) {
+        if (info)
+            info_request_init(&r->reqs[i]);
+        r->curl_handles[i] = wled_api_request(&loop_pool, addrs[i], "/json/info", info ? &r->reqs[i] : NULL, connect_timeout_ms, timeout_ms);
+        if (r->curl_handles[i])
+            r->num_active++;
+    }
 
-    if (strncmp(s, "</ds>", 5) != 0)
+    if (r->num_active == 0) {
+        remove_handles(&loop_pool, r->curl_handles, r->num_handles);
         return false;
+    }
+
+    r->done_func = done_func;
+    r->done_arg = done_arg;
+    r->finish_func = finish_func;
+    r->running = true;
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
 
     return true;
 }
 
-bool wled_api_check(const char *addr)
+void wled_api_init(void)
 {
-    char url[7 + MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 4 + 1];
-    CURL *curl_handle;
-    struct MemoryStruct chunk = { NULL, 0 };
-    CURLcode res;
-    bool xmlok = false;
+    // Not thread safe, called from main() before any thread is started
+    if (curl_initialized)
+        return;
 
-    snprintf(url, sizeof(url), "http://%s/win", addr);
-    //fprintf(stderr, "curl: %s\n", url);
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        fprintf(stderr, "wledapi: curl_global_init failed\n");
+        return;
+    }
+    curl_initialized = true;
 
-    curl_handle = curl_easy_init();
+    json_headers = curl_slist_append(NULL, "Content-Type: application/json");
+}
 
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_memory_callback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 10);
-    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 0L);
-    curl_easy_setopt(curl_handle, CURLOPT_MAXFILESIZE_LARGE, (off_t)(1024L*1024L));
+static bool wled_info_check(struct info_request *req)
+{
+    // The server description, a live stream does not change it
+    return json_finish(&req->parser) && strcmp(req->info.name, wled_ds) == 0;
+}
+
+static double get_elapsed_ms(const struct timespec *start)
+{
+    struct timespec now = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double)(now.tv_sec - start->tv_sec) * 1000.0) + ((double)(now.tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+static bool probe_done(size_t idx, CURL *curl, CURLcode res, void *arg)
+{
+    struct probe_round *round = arg;
+    bool infook;
 
-    res = curl_easy_perform(curl_handle);
+    (void)curl;
 
     if (res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        fprintf(stderr, "wledapi: address: %s, curl failed: %s\n", round->addrs[idx], curl_easy_strerror(res));
+        return false;
+    }
+
+    infook = wled_info_check(&round->reqs[idx]);
+    fprintf(stderr, "wledapi: address: %s, %s-WLED: %s\n", round->addrs[idx], wled_ds, (infook ? "yes" : "no"));
+    if (! infook)
+        return false;
+
+    round->winner = idx;
+    return true;
+}
+
+static bool info_done(size_t idx, CURL *curl, CURLcode res, void *arg)
+{
+    bool *ok = arg;
+
+    (void)idx;
+    (void)curl;
+
+    if (res != CURLE_OK) {
+        fprintf(stderr, "wledapi: curl failed: %s\n", curl_easy_strerror(res));
+        return true;
+    }
+
+    *ok = true;
+    return true;
+}
+
+// Fetches /json/info without checking the description, for controllers given by address
+bool wled_api_info(const char *addr, struct wled_info *info)
+{
+    CURL *curl;
+    struct info_request req;
+    bool ok = false;
+
+    if (! pool_lock(&pool))
+        return false;
+
+    info_request_init(&req);
+    curl = wled_api_request(&pool, addr, "/json/info", &req, WLED_PROBE_CONNECT_TIMEOUT_MS, WLED_PROBE_TIMEOUT_MS);
+    if (curl)
+        wled_api_run(&pool, &curl, 1, info_done, &ok);
+
+    pool_unlock(&pool);
+
+    if (! ok || ! json_finish(&req.parser))
+        return false;
+
+    *info = req.info;
+    return true;
+}
+
+static bool ping_done(size_t idx, CURL *curl, CURLcode res, void *arg)
+{
+    struct ping_round *round = arg;
+    long http_code = 0;
+
+    if (res == CURLE_OK)
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    round->rtt_ms[idx] = get_elapsed_ms(&round->start);
+    if (http_code == 200) {
+        round->ok[idx] = true;
+        round->num_ok++;
+    } else if (res != CURLE_OK) {
+        fprintf(stderr, "wledapi: ping %s failed: %s\n", round->addrs[idx], curl_easy_strerror(res));
     } else {
-        //fprintf(stderr, "%zu bytes retrieved\n", chunk.size);
-        //fprintf(stderr, "%.*s\n", (int)chunk.size, chunk.memory);
-        xmlok = wled_xml_check(&chunk);
-        fprintf(stderr, "wledapi: address: %s, %s-WLED: %s\n", addr, wled_ds, (xmlok ? "yes" : "no"));
+        fprintf(stderr, "wledapi: ping %s failed: HTTP %ld\n", round->addrs[idx], http_code);
+    }
+
+    return false;
+}
+
+static void probe_finish(void)
+{
+    struct loop_round *r = &loop_round;
+    struct wled_info info;
+    int winner = r->probe.winner;
+
+    fprintf(stderr, "wledapi: probed %zu address(es) in %.1f ms, found: %s\n", r->num_handles, get_elapsed_ms(&r->start), winner != -1 ? r->probe.addrs[winner] : "none");
+
+    // The callback may start the next round right away
+    if (winner != -1)
+        info = r->reqs[winner].info;
+    r->probe_func(winner, winner != -1 ? &info : NULL, r->arg);
+}
+
+// Probes all addresses at once, reports from the main loop the first one which is
+// our WLED and what it told about itself. Whatever is still running then has lost.
+bool wled_api_probe_async(const char * const *addrs, size_t num_addrs, wled_probe_func func, void *arg)
+{
+    struct loop_round *r = &loop_round;
+
+    if (! loop_round_start(addrs, num_addrs, true, WLED_PROBE_CONNECT_TIMEOUT_MS, WLED_PROBE_TIMEOUT_MS, probe_done, &r->probe, probe_finish))
+        return false;
+
+    r->probe.addrs = addrs;
+    r->probe.reqs = r->reqs;
+    r->probe.winner = -1;
+    r->probe_func = func;
+    r->arg = arg;
+
+    return true;
+}
+
+static void ping_finish(void)
+{
+    struct loop_round *r = &loop_round;
+
+    r->ping_func(r->ok, r->rtt_ms, r->arg);
+}
+
+// Cheap liveness check of already verified controllers, all addresses at once.
+// Reports from the main loop which ones answered and their round trip time in ms.
+bool wled_api_ping_async(const char * const *addrs, size_t num_addrs, wled_ping_func func, void *arg)
+{
+    struct loop_round *r = &loop_round;
+    size_t i;
+
+    if (! loop_round_start(addrs, num_addrs, false, WLED_PING_CONNECT_TIMEOUT_MS, WLED_PING_TIMEOUT_MS, ping_done, &r->ping, ping_finish))
+        return false;
+
+    for (i = 0; i < ARRAY_LENGTH(r->ok); i++) {
+        r->ok[i] = false;
+        r->rtt_ms[i] = 0.0;
+    }
+    r->ping.addrs = addrs;
+    r->ping.ok = r->ok;
+    r->ping.rtt_ms = r->rtt_ms;
+    r->ping.start = r->start;
+    r->ping.num_ok = 0;
+    r->ping_func = func;
+    r->arg = arg;
+
+    return true;
+}
+
+static void state_value(const char *path, int type, const char *value, size_t len, void *arg)
+{
+    bool *success = arg;
+
+    (void)value;
+    (void)len;
+
+    if (strcmp(path, "success") == 0)
+        *success = type == JSON_TYPE_TRUE;
+}
+
+static size_t state_callback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    struct json_parser *parser = userp;
+
+    if (! json_feed(parser, contents, size * nmemb))
+        return 0;
+
+    return size * nmemb;
+}
+
+static void lor_value(const char *path, int type, const char *value, size_t len, void *arg)
+{
+    int *lor = arg;
+
+    (void)len;
+
+    if (type == JSON_TYPE_NUMBER && strcmp(path, "lor") == 0)
+        *lor = atoi(value);
+}
+
+static bool state_done(size_t idx, CURL *curl, CURLcode res, void *arg)
+{
+    bool *ok = arg;
+
+    (void)idx;
+    (void)curl;
+
+    if (res != CURLE_OK) {
+        fprintf(stderr, "wledapi: state update failed: %s\n", curl_easy_strerror(res));
+        return true;
     }
 
-    curl_easy_cleanup(curl_handle);
+    *ok = true;
+    return true;
+}
+
+// Posts a partial state object to /json/state, WLED answers {"success":true}
+bool wled_api_state(const char *addr, const char *json)
+{
+    struct json_parser parser;
+    CURL *curl;
+    bool ok = false;
+    bool success = false;
+
+    if (! pool_lock(&state_pool))
+        return false;
 
-    if (chunk.memory) {
-        free(chunk.memory);
+    json_init(&parser, state_value, &success);
+    curl = wled_api_request(&state_pool, addr, "/json/state", NULL, WLED_STATE_CONNECT_TIMEOUT_MS, WLED_STATE_TIMEOUT_MS);
+    if (curl) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, state_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&parser);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, json_headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json);
+        wled_api_run(&state_pool, &curl, 1, state_done, &ok);
     }
 
-    return xmlok;
+    pool_unlock(&state_pool);
+
+    return ok && json_finish(&parser) && success;
+}
+
+// Reads the live override from /json/state, 0 means realtime data is shown
+bool wled_api_live_override(const char *addr, int *lor)
+{
+    struct json_parser parser;
+    CURL *curl;
+    bool ok = false;
+    int value = -1;
+
+    if (! pool_lock(&state_pool))
+        return false;
+
+    json_init(&parser, lor_value, &value);
+    curl = wled_api_request(&state_pool, addr, "/json/state", NULL, WLED_STATE_CONNECT_TIMEOUT_MS, WLED_STATE_TIMEOUT_MS);
+    if (curl) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, state_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&parser);
+        wled_api_run(&state_pool, &curl, 1, state_done, &ok);
+    }
+
+    pool_unlock(&state_pool);
+
+    if (! ok || ! json_finish(&parser) || value < 0)
+        return false;
+
+    *lor = value;
+    return true;
 }
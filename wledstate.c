@@ -0,0 +1,274 @@
+/* WLED state client (/json/state) */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "matelight.h"
+
+#define WLED_STATE_INTERVAL_MS  250     /* at most one request per interval, changes in between are merged */
+#define WLED_STATE_RETRY_MS     2000
+#define WLED_LOR_REFRESH        10      /* seconds between live override checks while streaming */
+#define WLED_LOR_MAX_FAILURES   5       /* failed checks in a row before giving up on a controller */
+
+#define STATE_ON                (1 << 0)
+#define STATE_BRI               (1 << 1)
+#define STATE_LOR               (1 << 2)
+
+/*
+ * Callers only record what they want, the worker thread sends whatever is
+ * dirty as one request. Values equal to what the controller already got are
+ * not sent again. While frames are streamed the worker looks at the live
+ * override now and then and only resets it if someone picked a preset in the
+ * meantime, checks back off when the controller does not answer.
+ */
+
+static pthread_t state_thread;
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond;       // on CLOCK_MONOTONIC, set up by wled_state_init()
+static bool state_running = false;
+
+static char state_address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)] = { 0 };
+static unsigned int dirty = 0;
+static unsigned int known = 0;          // fields set at least once, resent to a new controller
+static bool want_on = true;
+static int want_bri = 0;
+static bool sent_on = true;
+static int sent_bri = -1;
+static bool streaming = false;
+static struct timespec next_lor = { 0 };
+static unsigned int lor_failures = 0;
+
+static void timespec_add_ms(struct timespec *ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static bool lor_wanted(void)
+{
+    return streaming && *state_address && lor_failures < WLED_LOR_MAX_FAILURES;
+}
+
+// Called and returns with state_mutex held, false if it could not be taken again
+static bool check_lor(void)
+{
+    char address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+    int lor = 0;
+    bool ok;
+
+    memcpy(address, state_address, sizeof(address));
+
+    (void)pthread_mutex_unlock(&state_mutex);
+    ok = wled_api_live_override(address, &lor);
+    if (pthread_mutex_lock(&state_mutex) != 0)
+        return false;
+
+    // A new controller starts over with its own checks
+    if (strcmp(address, state_address) != 0)
+        return true;
+
+    clock_gettime(CLOCK_MONOTONIC, &next_lor);
+    if (ok) {
+        lor_failures = 0;
+        timespec_add_ms(&next_lor, WLED_LOR_REFRESH * 1000L);
+        if (lor != 0)
+            dirty |= STATE_LOR;
+    } else {
+        lor_failures++;
+        if (lor_failures == WLED_LOR_MAX_FAILURES)
+            fprintf(stderr, "wledstate: %s: no state API, not checking the live override anymore\n", address);
+        timespec_add_ms(&next_lor, (WLED_LOR_REFRESH * 1000L) << lor_failures);
+    }
+
+    return true;
+}
+
+static void *wled_state_thread_func(void *arg)
+{
+    char address[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+    char json[64];
+    struct timespec next = { 0 };
+    struct timespec now;
+    unsigned int fields;
+    bool on;
+    int bri;
+    int len;
+    bool ok;
+
+    (void)arg;
+
+    if (pthread_mutex_lock(&state_mutex) != 0)
+        return NULL;
+
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (lor_wanted() && ! timespec_before(&now, &next_lor)) {
+            if (! check_lor())
+                return NULL;
+            continue;
+        }
+
+        if (! dirty || ! *state_address) {
+            if (lor_wanted()) {
+                (void)pthread_cond_timedwait(&state_cond, &state_mutex, &next_lor);
+            } else {
+                (void)pthread_cond_wait(&state_cond, &state_mutex);
+            }
+            continue;
+        }
+
+        // Rate limit, whatever comes in meanwhile goes into the same request
+        if (timespec_before(&now, &next)) {
+            while (pthread_cond_timedwait(&state_cond, &state_mutex, &next) != ETIMEDOUT)
+                ;
+            continue;
+        }
+
+        fields = dirty;
+        dirty = 0;
+        on = want_on;
+        bri = want_bri;
+        memcpy(address, state_address, sizeof(address));
+
+        (void)pthread_mutex_unlock(&state_mutex);
+
+        len = snprintf(json, sizeof(json), "{");
+        if (fields & STATE_ON)
+            len += snprintf(json + len, sizeof(json) - len, "%s\"on\":%s", len > 1 ? "," : "", on ? "true" : "false");
+        if (fields & STATE_BRI)
+            len += snprintf(json + len, sizeof(json) - len, "%s\"bri\":%d", len > 1 ? "," : "", bri);
+        if (fields & STATE_LOR)
+            len += snprintf(json + len, sizeof(json) - len, "%s\"lor\":0", len > 1 ? "," : "");
+        (void)snprintf(json + len, sizeof(json) - len, "}");
+
+        ok = wled_api_state(address, json);
+        fprintf(stderr, "wledstate: %s %s: %s\n", address, json, ok ? "ok" : "failed");
+
+        if (pthread_mutex_lock(&state_mutex) != 0)
+            return NULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        if (ok) {
+            if (fields & STATE_ON)
+                sent_on = on;
+            if (fields & STATE_BRI)
+                sent_bri = bri;
+            timespec_add_ms(&next, WLED_STATE_INTERVAL_MS);
+        } else if (strcmp(address, state_address) == 0) {
+            // Try again later unless the controller changed meanwhile, then it gets everything anyway.
+            // The live override is left to the next check.
+            dirty |= fields & ~STATE_LOR;
+            timespec_add_ms(&next, WLED_STATE_RETRY_MS);
+        }
+    }
+
+    (void)pthread_mutex_unlock(&state_mutex);
+
+    return NULL;
+}
+
+static void mark_dirty(unsigned int field)
+{
+    dirty |= field;
+    known |= field;
+    (void)pthread_cond_signal(&state_cond);
+}
+
+void wled_state_init(void)
+{
+    pthread_condattr_t attr;
+
+    // Deadlines must not move with the wall clock
+    if (pthread_condattr_init(&attr) != 0 || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&state_cond, &attr) != 0) {
+        fprintf(stderr, "wledstate: unable to set up the worker\n");
+        return;
+    }
+    (void)pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&state_thread, NULL, wled_state_thread_func, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+
+    (void)pthread_detach(state_thread);
+    state_running = true;
+}
+
+void wled_state_set_address(const char *address)
+{
+    if (! state_running || pthread_mutex_lock(&state_mutex) != 0)
+        return;
+
+    if (strcmp(state_address, address) != 0) {
+        strncpy(state_address, address, sizeof(state_address) - 1);
+        // A different controller does not know what we told the last one
+        sent_bri = -1;
+        next_lor.tv_sec = 0;
+        next_lor.tv_nsec = 0;
+        lor_failures = 0;
+        dirty |= known & ~STATE_LOR;
+        if (dirty)
+            (void)pthread_cond_signal(&state_cond);
+    }
+
+    (void)pthread_mutex_unlock(&state_mutex);
+}
+
+void wled_state_set_on(bool on)
+{
+    if (! state_running || pthread_mutex_lock(&state_mutex) != 0)
+        return;
+
+    want_on = on;
+    if (on != sent_on || ! (known & STATE_ON)) {
+        mark_dirty(STATE_ON);
+    } else {
+        dirty &= ~STATE_ON;
+    }
+
+    (void)pthread_mutex_unlock(&state_mutex);
+}
+
+void wled_state_set_brightness(int bri)
+{
+    if (! state_running || pthread_mutex_lock(&state_mutex) != 0)
+        return;
+
+    want_bri = MAX(1, MIN(bri, 255));
+    if (want_bri != sent_bri) {
+        mark_dirty(STATE_BRI);
+    } else {
+        dirty &= ~STATE_BRI;
+    }
+
+    (void)pthread_mutex_unlock(&state_mutex);
+}
+
+// Live override checks only run while frames are streamed, call on changes only
+void wled_state_set_streaming(bool on)
+{
+    if (! state_running || pthread_mutex_lock(&state_mutex) != 0)
+        return;
+
+    streaming = on;
+    if (on)
+        (void)pthread_cond_signal(&state_cond);
+
+    (void)pthread_mutex_unlock(&state_mutex);
+}